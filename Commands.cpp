@@ -338,14 +338,17 @@ void commandDump() {
 		Serial.println(F("FIN"));
 	}
 	for (int i = 0; i < maxSensorCount; i++) {
-		const Sensor& s = sensors[i];
-		if (s.sensorId == 0) {
+		if (!sensors.isDefined(i)) {
 			continue;
 		}
-		s.dumpTimeouts();
+		sensors.dumpTimeouts(i);
 	}
 }
 
+void commandTransitions() {
+	dumpTransitions();
+}
+
 void commandDelete() {
 	int ln = nextNumber();
 	if (ln < 0) {
@@ -396,25 +399,25 @@ void commandSensorTimeouts() {
 		Serial.print(F("Invalid sensor number"));
 		return;
 	}
-	int id = -1;
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == num) {
-			id = i;
-			break;
-		}
-	}
-	if (id == -1) {
+	int slot = findSensor(num);
+	if (slot < 0) {
 		Serial.println(F("Sensor unknown."));
 		return;
 	}
-	Sensor &target = sensors[id];
 
 	if (*inputPos == 0) {
 		Serial.println(F("Resetting to defaults."));
-		target.sensorUpDebounce = target.sensorDownDebounce = 0;
+		sensors.upDebounce[slot] = sensors.downDebounce[slot] = 0;
+#ifdef __s88_frame_filter
+		setFrameFilter(slot, 0, 0);
+#endif
+		s88TimingChanged();
 		return;
 	}
+#ifdef __s88_frame_filter
+	int votes = -1;
+	int window = -1;
+#endif
 	while (*inputPos != 0) {
 		char c = *(inputPos++);
 		if (*inputPos != '=') {
@@ -428,16 +431,39 @@ void commandSensorTimeouts() {
 		}
 		switch (c) {
 			case 'U': case 'u':
-				target.sensorUpDebounce = t;
+				sensors.upDebounce[slot] = t;
 				break;
 			case 'D': case 'd':
-				target.sensorDownDebounce = t;
+				sensors.downDebounce[slot] = t;
 				break;
+#ifdef __s88_frame_filter
+			case 'K': case 'k':
+				votes = t;
+				break;
+			case 'N': case 'n':
+				window = t;
+				break;
+#endif
 			default:
 				Serial.println(F("Syntax error."));
 				return;
 		}
+		s88TimingChanged();
+	}
+#ifdef __s88_frame_filter
+	if (votes < 0 && window < 0) {
+		return;
+	}
+	// N alone requires N consecutive frames, K alone a majority of 2K - 1
+	if (window < 0) {
+		window = 2 * votes - 1;
+	} else if (votes < 0) {
+		votes = window;
+	}
+	if (votes > s88FilterMaxFrames || window > s88FilterMaxFrames || !setFrameFilter(slot, votes, window)) {
+		Serial.println(F("Invalid filter."));
 	}
+#endif
 }
 
 
@@ -450,6 +476,7 @@ void initCommands() {
   registerLineCommand("FIN", &commandFinish);
   registerLineCommand("DEL", &commandDelete);
   registerLineCommand("DMP", &commandDump);
+  registerLineCommand("LSM", &commandTransitions);
   registerLineCommand("STM", &commandSensorTimeouts);
 }
 
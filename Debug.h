@@ -24,6 +24,7 @@ const int debugTransitions = 1;
 const int debugRelays = 1;
 
 #undef __test_s88
+#undef __test_s88_debounce
 #define __test_loop
 
 #undef __test_baloon
@@ -33,6 +33,7 @@ const int reportS88Loss = 1;          // will flash LED if S88 CLK signal is not
 
 const int eepromVersion = 0x00;
 const int eepromSensors = 0x02;
+const int eepromS88Config = 0xA0;
 const int eepromLoopDefs = 0xC0;
 const int eepromChecksum = 0x1F0;
 
@@ -0,0 +1,74 @@
+/*
+ * FastIO.h
+ *
+ *  Created on: Apr 10, 2021
+ *      Author: sdedic
+ */
+
+#ifndef FASTIO_H_
+#define FASTIO_H_
+
+#include <Arduino.h>
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__)
+#define __fastio_avr
+#endif
+
+/**
+ * Direct port access to a pin known at compile time. The port registers and the
+ * bit mask are resolved by the compiler, so read() and write() compile down to
+ * a single in/sbi/cbi instruction instead of the pin table lookups done by
+ * digitalRead() / digitalWrite(). Use with the constants from PinOut.h.
+ *
+ * On boards with an unknown pin layout falls back to the Arduino functions.
+ */
+template<int pin> struct FastPin {
+#ifdef __fastio_avr
+	/**
+	 * Bit of the pin within its port: D0-D7 = PORTD, D8-D13 = PORTB, A0-A5 = PORTC.
+	 */
+	static const byte mask = 1 << (pin < 8 ? pin : (pin < 14 ? pin - 8 : pin - 14));
+
+	static inline __attribute__((always_inline)) volatile uint8_t& inReg() {
+		return pin < 8 ? PIND : (pin < 14 ? PINB : PINC);
+	}
+
+	static inline __attribute__((always_inline)) volatile uint8_t& outReg() {
+		return pin < 8 ? PORTD : (pin < 14 ? PORTB : PORTC);
+	}
+
+	static inline __attribute__((always_inline)) boolean read() {
+		return (inReg() & mask) != 0;
+	}
+
+	static inline __attribute__((always_inline)) void high() {
+		outReg() |= mask;
+	}
+
+	static inline __attribute__((always_inline)) void low() {
+		outReg() &= ~mask;
+	}
+#else
+	static inline boolean read() {
+		return digitalRead(pin) == HIGH;
+	}
+
+	static inline void high() {
+		digitalWrite(pin, HIGH);
+	}
+
+	static inline void low() {
+		digitalWrite(pin, LOW);
+	}
+#endif
+
+	static inline __attribute__((always_inline)) void write(boolean v) {
+		if (v) {
+			high();
+		} else {
+			low();
+		}
+	}
+};
+
+#endif /* FASTIO_H_ */
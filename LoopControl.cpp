@@ -5,9 +5,6 @@
 #include "Terminal.h"
 #include "Defs.h"
 
-extern long cummulativeS88;
-extern long s88IntCount;
-
 void setup() {
 	Serial.begin(115200);
 	Serial.println(STARTUP_MSG);
@@ -27,7 +24,4 @@ void setup() {
 void loop() {
 	processTerminal();
 	ModuleChain::invokeAll(periodic);
-	if ((s88IntCount > 0) && (s88IntCount % 100) == 0) {
-		Serial.print("S88 period: "); Serial.println(cummulativeS88 / s88IntCount);
-	}
 }
@@ -50,556 +50,789 @@ boolean logTransitions = true;
  * - if exit conditions are met, Moving transitions to Armed
  * - if other endpoint's enter conditions are met, Idle transitions to Approach.
  *
+ * The automaton is written down as two tables of (states, guard, action, next state) rows, kept
+ * in flash. sensorTransitions are evaluated when sensors of the loop change, entryTransitions
+ * when a state is entered: they perform the entry actions and the automatic transitions above.
+ * The rows of a state are evaluated in order; the first row whose guard holds runs its action
+ * and switches to the next state. The LSM command dumps both tables.
  */
 
-void LoopState::maybeArm(const Endpoint& via) {
-	const LoopDef& d = def();
-	if (!d.core.occupied()) {
-		switchStatus(idle, via);
-		return;
-	}
-	if (!via.isPrimedExit()) {
-		if (debugTransitions) {
-			Serial.println(F("Exit not ready"));
-		}
-		return;
-	}
-	const Endpoint& from = d.opposite(via);
-	if (from.hasTriggerSensors()) {
-		if (from.sensorsActive()) {
-			if (debugTransitions) {
-				Serial.println(F("In sensors still active"));
-			}
-			markDirSensor(false);
-			return;
-		} else if (!dirSensorTimeout(true)) {
-			return;
-		}
-	}
-	if (via.sensorOut > 0) {
-		if (!via.sensorsActive()) {
-			if (debugTransitions) {
-				Serial.println(F("Exit out sensor NOT active"));
-			}
-			return;
-		}
-	}
-	if (d.core.isDirectionPrimed(directionTo(via) == left)) {
-		switchStatus(armed, via);
-	}
+/**
+ * Arguments of the guards and actions. 'changed' are the changed sensors, one bit per slot,
+ * none on entry to a state. 'ep' is the endpoint the state refers to: fromEdge()
+ * or toEdge() at the time the sensor change arrived, or the endpoint the state was entered
+ * through. 'target' is the endpoint selected by the row, resolved before its action runs.
+ */
+struct TransitionContext {
+	slotmask_t changed;
+	const Endpoint* ep;
+	const Endpoint* target;
+	Status oldStatus;
+};
+
+typedef boolean (*TransitionGuard)(LoopState& st, const LoopDef& d, const TransitionContext& c);
+typedef void (*TransitionAction)(LoopState& st, const LoopDef& d, const TransitionContext& c);
+
+/**
+ * Special values of Transition::next and Transition::after.
+ */
+const byte tKeep = 0x0d;	// next: the row does not switch the state
+const byte tStop = 0x0e;	// after: done with the change
+const byte tResume = 0x0f;	// after: evaluate the following rows of the original state
+
+/**
+ * Endpoint passed to switchStatus(), see TransitionContext.
+ */
+enum TransitionTarget {
+	toParam,
+	toOpposite,
+	toLeft,
+	toRight,
+	toFromEdge
+};
+
+struct Transition {
+	/**
+	 * States the row applies to, one bit per Status.
+	 */
+	unsigned int states;
+	byte guard;
+	byte action;
+
+	/**
+	 * The new state, or tKeep.
+	 */
+	byte next;
+
+	/**
+	 * tStop, tResume, or a state to switch to right after 'next', through the same endpoint.
+	 */
+	byte after;
+	byte target;
+};
+
+#define when(s) (1u << (s))
+
+boolean guardAlways(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return true;
 }
 
-void LoopState::processReadyEnter(int sensor, const Endpoint& ep) {
-	processApproach(sensor, ep);
+// this is a possible boot-up from power loss or a short
+boolean leftWasPrimed(const LoopDef& d) {
+	return d.left.hasChanged() && d.left.test(epPrimedEnter);
 }
 
-void LoopState::processApproach(int sensor, const Endpoint& from) {
-	const LoopDef& d = def();
-	if (from.hasSensor(sensor) && from.changedOccupied(sensor, false)) {
-		if (d.core.isPrimed()) {
-			if (debugTransitions) {
-				Serial.println(F("Core section jumped to"));
-			}
-			switchStatus(moving, from);
-			return;
-		} else {
-			if (debugTransitions) {
-				Serial.println(F("Left & core is empty"));
-			}
-			switchStatus(idle, from);
-		}
+boolean rightWasPrimed(const LoopDef& d) {
+	return d.right.hasChanged() && d.right.test(epPrimedEnter);
+}
+
+boolean coreWasPrimed(const LoopDef& d) {
+	return d.core.hasChanged() && d.core.isPrimed();
+}
+
+boolean guardColdBootOccupied(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return coreWasPrimed(d) && (leftWasPrimed(d) == rightWasPrimed(d));
+}
+
+boolean guardColdBootLeft(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return coreWasPrimed(d) && leftWasPrimed(d) && !rightWasPrimed(d);
+}
+
+boolean guardColdBootRight(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return coreWasPrimed(d) && rightWasPrimed(d) && !leftWasPrimed(d);
+}
+
+/**
+ * If both endpoints are ready, enters the one which is already primed, none if both are.
+ */
+boolean readyToEnter(const Endpoint& ep, const Endpoint& opp, slotmask_t changed) {
+	if (!ep.hasSensorIn(changed) || !ep.test(epValidEnter)) {
+		return false;
 	}
-	if (d.core.hasSensor(sensor)) {
-		if (debugTransitions) {
-			Serial.println(F("Core sensor changed"));
-			Serial.println(direction == left ? F(" -> Left") : F("-> Right"));
-			Serial.println(&from == &d.left ? F("Left") : F("Right"));
-		}
-		if (d.core.isPrimed()) {
-			if (from.occupied()) {
-				if (debugTransitions) {
-					Serial.println(F("Core section partially entered"));
-				}
-				switchStatus(entering, from);
-				return;
-			} else {
-				if (debugTransitions) {
-					Serial.println(F("Jumped into core"));
-				}
-				switchStatus(moving, from);
-				return;
-			}
-		}
-	} else if (status == approach) {
-		maybeReadyEnter(from);
+	if (!opp.hasSensorIn(changed) || !opp.test(epValidEnter)) {
+		return true;
 	}
+	return ep.test(epPrimedEnter) && !opp.test(epPrimedEnter);
 }
 
-void LoopState::maybeApproach(Status prevStatus, const Endpoint& from) {
-	if (!from.isPrimedEnter()) {
-		return;
-	}
-	direction = directionFrom(from);
-	switchStatus(approach, from);
+boolean guardEnterLeft(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return readyToEnter(d.left, d.right, c.changed);
 }
 
-void LoopState::maybeReadyEnter(const Endpoint& from) {
-	boolean transition = false;
+boolean guardEnterRight(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return readyToEnter(d.right, d.left, c.changed);
+}
 
-	if (from.isPrimedEnter()) {
-		switchStatus(readyEnter, from);
-	}
+boolean guardLeftExit(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.left.hasSensorIn(c.changed) && d.left.test(epPrimedExit);
 }
 
-void LoopState::maybeFreeRelay(const Endpoint& via) {
-	if (via.sensorIn > 0) {
-		const Endpoint &opp = def().opposite(via);
-		if ((opp.sensorIn == 0) && (opp.relay > 0)) {
-			if (logTransitions) {
-				Serial.print(F("Opposite has no sensor, conservative switch to opposite"));
-			}
-			switchRelayTo(opp);
-		}
-	}
+boolean guardLeftExitEmpty(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return guardLeftExit(st, d, c) && d.left.occupiedTrackSensors() == 0;
 }
 
-void LoopState::switchStatus(Status s, const Endpoint& ep) {
-	Status oldStatus = status;
-	Direction oldDirection = direction;
+boolean guardRightExit(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.right.hasSensorIn(c.changed) && d.right.test(epPrimedExit);
+}
 
-	status = s;
-	if (logTransitions) {
-		Serial.print('#'); Serial.print(id() + 1);
-		Serial.print(F(": Change status: ")); Serial.print(statName(oldStatus)); Serial.print(F(" => ")); Serial.print(statName(s));
-		Serial.print(F(", Direction: ")); Serial.println(direction ? F("left") : F("right"));
-	}
-	const LoopDef& d = def();
+boolean guardRightExitEmpty(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return guardRightExit(st, d, c) && d.right.occupiedTrackSensors() == 0;
+}
 
-	switch (s) {
-		default:
-			Serial.print(F("*Unhandled state: ")); Serial.print(s); Serial.print('-'); Serial.println(statName(s));
-			break;
+boolean guardTracksEmpty(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.occupiedTrackSensors() == 0;
+}
 
-		case exited:
-			maybeFreeRelay(ep);
-			break;
+boolean guardCoreOccupied(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.core.occupied();
+}
 
-		case approach:
-			/*
-			switchRelay(fromEdge().relay, fromEdge().relayTriggerState);
-			markDirSensor(false);
-			*/
-			maybeReadyEnter(fromEdge());
-			break;
+boolean guardLeftOccupied(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.left.hasSensorIn(c.changed) && d.left.test(epOccupied);
+}
 
-		case readyEnter:
-			switchRelay(fromEdge().relay, fromEdge().relayTriggerState);
-			markDirSensor(false);
-			break;
+boolean guardRightOccupied(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.right.hasSensorIn(c.changed) && d.right.test(epOccupied);
+}
 
-		case armed:
-			direction = directionTo(ep);
-			markDirSensor(true);
-			switchRelay(toEdge().relay, toEdge().relayTriggerState);
-			break;
+boolean guardVacated(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->hasSensorIn(c.changed) && c.ep->changedOccupied(c.changed, false);
+}
 
-		case idle:
-			switchRelay(d.left.relay, d.left.relayOffState);
-			switchRelay(d.right.relay, d.right.relayOffState);
+boolean guardVacatedCorePrimed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return guardVacated(st, d, c) && d.core.isPrimed();
+}
 
-			maybeApproach(oldStatus, d.opposite(ep));
-			break;
+boolean guardCoreSensor(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.core.hasSensorIn(c.changed);
+}
 
-		case moving:
-			leftSensorTime = rightSensorTime = 0;
-			direction = directionFrom(ep);
-			if (oldStatus == entering) {
-				markDirSensor(false);
-			}
-			const Endpoint& opp = d.opposite(ep);
-			maybeArm(opp);
-			break;
-	}
-	if (status == idle) {
-		if (logTransitions) {
-			Serial.println(F("Clearing trigger sensors"));
-		}
-		outageStart = 0;
-		leftSensorTime = rightSensorTime = 0;
-	}
+boolean guardCoreSensorPrimed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.core.hasSensorIn(c.changed) && d.core.isPrimed();
+}
+
+boolean guardCorePartiallyEntered(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return guardCoreSensorPrimed(st, d, c) && c.ep->test(epOccupied);
+}
+
+boolean guardApproachPrimed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return st.status == approach && c.ep->test(epPrimedEnter);
+}
+
+boolean guardMovedToCentre(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->hasSensorIn(c.changed) && !c.ep->test(epPrimedEnter) && d.core.isPrimed();
+}
+
+boolean guardMovingReverse(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.core.hasSensorIn(c.changed) && !d.core.isPrimed() && c.ep->test(epOccupied);
+}
+
+boolean guardCoreAbandoned(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.core.isPrimed();
+}
+
+boolean guardCoreLeftOnly(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.core.isPrimed() && d.left.test(epOccupied) && !d.right.test(epOccupied);
+}
+
+boolean guardCoreRightOnly(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.core.isPrimed() && !d.left.test(epOccupied) && d.right.test(epOccupied);
+}
+
+boolean guardExitPrimed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	const Endpoint& opp = d.opposite(*c.ep);
+	return (opp.hasSensorIn(c.changed) || c.ep->hasTriggerIn(c.changed)) && opp.test(epPrimedExit);
 }
 
 /**
- * IDLE ->
- *
- * left primed => enteringLeft
- * right primed => enteringRight
- *
- * core appeared (no left or right) => occupied
+ * Only the entry has trigger sensors: the train must have passed them before leaving.
  */
-void LoopState::processIdle(int sensor) {
-	const LoopDef& d = def();
+boolean guardExitAwaitsIn(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return guardExitPrimed(st, d, c) && c.ep->hasTriggerSensors() &&
+			!d.opposite(*c.ep).hasTriggerSensors() && !st.dirSensorTimeout(false);
+}
 
-	// this is a possible boot-up from power loss or a short
-	boolean leftWasPrimed = d.left.hasChanged() && d.left.isPrimedEnter();
-	boolean rightWasPrimed = d.right.hasChanged() && d.right.isPrimedEnter();
-	boolean coreWasPrimed = d.core.hasChanged() && d.core.isPrimed();
+boolean guardTurnPrimed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->hasSensorIn(c.changed) && c.ep->test(epPrimedExit);
+}
 
-	if (coreWasPrimed) {
-		if (leftWasPrimed && rightWasPrimed) {
-			if (debugTransitions) {
-				Serial.print("Cold boot: occupied, waiting for changes");
-			}
-			switchStatus(occupied, d.left);
-			return;
-		}
-		if (!(leftWasPrimed || rightWasPrimed)) {
-			if (debugTransitions) {
-				Serial.print("Cold boot: occupied, direction unknown");
-			}
-			switchStatus(occupied, d.left);
-			return;
-		}
-		if (leftWasPrimed) {
-			direction = left;
-			if (debugTransitions) {
-				Serial.print(F("Cold boot: core + left"));
-			}
-			switchStatus(armed, d.left);
-			switchStatus(exiting, d.left);
-		} else if (rightWasPrimed) {
-			direction = right;
-			if (debugTransitions) {
-				Serial.print(F("Cold boot: core + right"));
-			}
-			switchStatus(armed, d.right);
-			switchStatus(exiting, d.right);
-		}
-		return;
-	}
+boolean guardTurnedBack(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->hasSensorIn(c.changed) && c.ep->test(epOccupied);
+}
 
-	if (debugTransitions) {
-		Serial.println(F("Checking left"));
-	}
-	boolean leftReady = d.left.hasSensor(sensor) && d.left.isValidEnter();
-	if (debugTransitions) {
-		Serial.println(F("Checking right"));
-	}
-	boolean rightReady = d.right.hasSensor(sensor) && d.right.isValidEnter();
+boolean reversedWhileArmed(const LoopDef& d, const TransitionContext& c) {
+	return !c.ep->hasSensorIn(c.changed) && sensorInSet(c.changed, d.opposite(*c.ep).sensorOut);
+}
 
-	if (debugTransitions) {
-		Serial.print(F("Left:  ")); d.left.printState();
-		Serial.print(F("Right: ")); d.right.printState();
-	}
+boolean guardArmedUnrelated(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !c.ep->hasSensorIn(c.changed) && !sensorInSet(c.changed, d.opposite(*c.ep).sensorOut);
+}
 
-	if (leftReady && rightReady) {
-		// try to determine if one of the 'ready' endpoints is already primed:
-		boolean leftPrimed = d.left.isPrimedEnter();
-		boolean rightPrimed = d.right.isPrimedEnter();
-		if (leftPrimed && !rightPrimed) {
-			rightReady = false;
-		} else if (rightPrimed && !leftPrimed) {
-			leftReady = false;
-		} else {
-			// no op
-			if (debugTransitions) {
-				Serial.println(F("Both active => idle"));
-			}
-			return;
-		}
-	}
-	if (leftReady) {
-		direction = right;
-		switchStatus(approach, d.left);
-	} else if (rightReady) {
-		direction = left;
-		switchStatus(approach, d.right);
-	}
+boolean guardReversedWhileArmed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return logTransitions && reversedWhileArmed(d, c);
 }
 
-boolean LoopState::dirSensorTimeout(boolean moveOut) const {
-	const Endpoint ep = moveOut ? toEdge() : fromEdge();
-	if (!ep.hasTriggerSensors()) {
-		return true;
-	}
-	if (ep.sensorsActive()) {
-		if (debugTransitions) {
-			Serial.println(F("Sensors still active"));
-		}
-		return false;
-	}
-	long dst = dirSensorTime(moveOut);
-	if (dst == 0) {
-		return true;
-	}
-	long d = millis() - dst;
+boolean guardExitEntered(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->changedOccupied(c.changed, true);
+}
+
+boolean guardExitInvalid(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	const Endpoint& to = *c.ep;
+	return reversedWhileArmed(d, c) ||
+			(to.test(epValidExit) && to.hasTriggerSensors() && st.dirSensorTimeout(true)) ||
+			!to.test(epPrimedExit);
+}
+
+boolean guardOutSensorsActive(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.core.isPrimed() && c.ep->hasTriggerSensors() && c.ep->sensorsActive();
+}
+
+boolean guardOutTimeoutPending(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.core.isPrimed() && c.ep->hasTriggerSensors() && !st.dirSensorTimeout(true);
+}
+
+boolean guardCoreReentered(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.core.hasSensorIn(c.changed) && d.core.isPrimed();
+}
+
+boolean guardInSensorFired(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return sensorInSet(c.changed, c.ep->sensorIn) && readSensor(c.ep->sensorIn) != c.ep->invertInSensor;
+}
+
+boolean guardOppositePrimedEnter(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.opposite(*c.ep).test(epPrimedEnter);
+}
+
+boolean guardFromEdgePrimedEnter(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return st.fromEdge().test(epPrimedEnter);
+}
+
+boolean guardCoreEmpty(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.core.occupied();
+}
+
+boolean guardExitNotReady(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return !d.opposite(*c.ep).test(epPrimedExit);
+}
+
+boolean guardInSensorsActive(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->hasTriggerSensors() && c.ep->sensorsActive();
+}
+
+boolean guardInTimeoutPending(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return c.ep->hasTriggerSensors() && !st.dirSensorTimeout(true);
+}
+
+boolean guardExitOutInactive(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	const Endpoint& via = d.opposite(*c.ep);
+	return via.sensorOut > 0 && !via.sensorsActive();
+}
+
+boolean guardExitDirectionPrimed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	return d.core.isDirectionPrimed(st.directionTo(d.opposite(*c.ep)) == left);
+}
+
+/**
+ * Guard identifiers, indexes into 'guards' and 'guardNames'.
+ */
+enum TransitionGuardId {
+	gAlways,
+	gColdBootOccupied,
+	gColdBootLeft,
+	gColdBootRight,
+	gEnterLeft,
+	gEnterRight,
+	gLeftExitEmpty,
+	gLeftExit,
+	gRightExitEmpty,
+	gRightExit,
+	gTracksEmpty,
+	gCoreOccupied,
+	gLeftOccupied,
+	gRightOccupied,
+	gVacated,
+	gVacatedCorePrimed,
+	gCoreSensor,
+	gCoreSensorPrimed,
+	gCorePartiallyEntered,
+	gApproachPrimed,
+	gMovedToCentre,
+	gMovingReverse,
+	gCoreAbandoned,
+	gCoreLeftOnly,
+	gCoreRightOnly,
+	gExitPrimed,
+	gExitAwaitsIn,
+	gTurnPrimed,
+	gTurnedBack,
+	gArmedUnrelated,
+	gReversedWhileArmed,
+	gExitEntered,
+	gExitInvalid,
+	gOutSensorsActive,
+	gOutTimeoutPending,
+	gCoreReentered,
+	gInSensorFired,
+	gOppositePrimedEnter,
+	gFromEdgePrimedEnter,
+	gCoreEmpty,
+	gExitNotReady,
+	gInSensorsActive,
+	gInTimeoutPending,
+	gExitOutInactive,
+	gExitDirectionPrimed
+};
+
+const TransitionGuard guards[] PROGMEM = {
+	&guardAlways,
+	&guardColdBootOccupied,
+	&guardColdBootLeft,
+	&guardColdBootRight,
+	&guardEnterLeft,
+	&guardEnterRight,
+	&guardLeftExitEmpty,
+	&guardLeftExit,
+	&guardRightExitEmpty,
+	&guardRightExit,
+	&guardTracksEmpty,
+	&guardCoreOccupied,
+	&guardLeftOccupied,
+	&guardRightOccupied,
+	&guardVacated,
+	&guardVacatedCorePrimed,
+	&guardCoreSensor,
+	&guardCoreSensorPrimed,
+	&guardCorePartiallyEntered,
+	&guardApproachPrimed,
+	&guardMovedToCentre,
+	&guardMovingReverse,
+	&guardCoreAbandoned,
+	&guardCoreLeftOnly,
+	&guardCoreRightOnly,
+	&guardExitPrimed,
+	&guardExitAwaitsIn,
+	&guardTurnPrimed,
+	&guardTurnedBack,
+	&guardArmedUnrelated,
+	&guardReversedWhileArmed,
+	&guardExitEntered,
+	&guardExitInvalid,
+	&guardOutSensorsActive,
+	&guardOutTimeoutPending,
+	&guardCoreReentered,
+	&guardInSensorFired,
+	&guardOppositePrimedEnter,
+	&guardFromEdgePrimedEnter,
+	&guardCoreEmpty,
+	&guardExitNotReady,
+	&guardInSensorsActive,
+	&guardInTimeoutPending,
+	&guardExitOutInactive,
+	&guardExitDirectionPrimed
+};
+
+/**
+ * Names for the dump, NUL-separated in the TransitionGuardId order.
+ */
+const char guardNames[] PROGMEM =
+	"always\0coldBootOccupied\0coldBootLeft\0coldBootRight\0enterLeft\0enterRight\0"
+	"leftExitEmpty\0leftExit\0rightExitEmpty\0rightExit\0tracksEmpty\0coreOccupied\0"
+	"leftOccupied\0rightOccupied\0vacated\0vacatedCorePrimed\0coreSensor\0coreSensorPrimed\0"
+	"corePartiallyEntered\0approachPrimed\0movedToCentre\0movingReverse\0coreAbandoned\0"
+	"coreLeftOnly\0coreRightOnly\0exitPrimed\0exitAwaitsIn\0turnPrimed\0turnedBack\0"
+	"armedUnrelated\0reversedWhileArmed\0exitEntered\0exitInvalid\0outSensorsActive\0"
+	"outTimeoutPending\0coreReentered\0inSensorFired\0oppositePrimedEnter\0fromEdgePrimedEnter\0"
+	"coreEmpty\0exitNotReady\0inSensorsActive\0inTimeoutPending\0exitOutInactive\0"
+	"exitDirectionPrimed";
+
+void actionNone(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+}
+
+void actionDirLeft(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.direction = left;
+}
+
+void actionDirRight(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.direction = right;
+}
+
+void actionReverse(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.direction = st.reversed();
+}
+
+void actionDirFromTarget(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.direction = st.directionFrom(*c.target);
+}
+
+void actionRunTimeout(LoopState& st, const LoopDef& d, const TransitionContext& c) {
 	if (debugTransitions) {
-		Serial.print(F("Sensor diff: ")); Serial.println(d);
+		Serial.println(F("Disappeared ! Running timeout."));
 	}
-	return d > def().sensorTimeout;
+	st.timeout = loopMillis();
 }
 
-void LoopState::processEntering(int sensor, const Endpoint& from) {
-	const LoopDef& d = def();
-	Direction reversed = direction == left ? right : left;
-	boolean movedToCentre = false;
-	boolean movingReverse = false;
-
-	if (from.hasSensor(sensor) && !from.isPrimedEnter()) {
-		// moved from cross-edge to core only, or leaving back
-		if (d.core.isPrimed()) {
-			movedToCentre = true;
-		}
-	}
-	if (d.core.hasSensor(sensor) && !d.core.isPrimed()) {
-		if (from.occupied()) {
-			movingReverse = true;
-		}
-	}
-	if (movedToCentre) {
-		if (debugTransitions) {
-			Serial.println(F("Fully in core"));
-		}
-		switchStatus(moving, from);
-	} else if (movingReverse) {
+void actionMarkIn(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.markDirSensor(false);
+}
+
+void actionMarkOut(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.markDirSensor(true);
+}
+
+void actionLogReversed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	Serial.print(F("Train reversed while armed for ")); Serial.println(st.direction == left ? "left" : "right");
+}
+
+void actionRevertRelay(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	// exit has safety sensor, no need to change direction
+	const Endpoint& from = d.opposite(*c.ep);
+	if (c.ep->sensorOut > 0 && from.sensorOut == 0) {
+		// but the opposite has no sensor; flip the relay just in case.
+		st.switchRelayTo(from);
 		if (debugTransitions) {
-			Serial.println(F("Reversed"));
+			Serial.println(F("Relay switched to opposite"));
 		}
-		direction = reversed;
-		switchStatus(exited, d.opposite(from));
 	}
 }
 
-void LoopState::processMoving(int sensor, const Endpoint& from) {
-	const LoopDef& d = def();
-	const Endpoint& opp = d.opposite(from);
+void actionRelaysOff(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	switchRelay(d.left.relay, d.left.relayOffState);
+	switchRelay(d.right.relay, d.right.relayOffState);
+}
 
-	if (maybeCoreAbandoned(sensor)) {
-		return;
-	}
+void actionReadyEnter(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	switchRelay(st.fromEdge().relay, st.fromEdge().relayTriggerState);
+	st.markDirSensor(false);
+}
 
-	if ((opp.hasSensor(sensor) || from.hasTrigger(sensor))) {
-		if (opp.isPrimedExit()) {
-			if (debugTransitions) {
-				Serial.println(F("Can exit loop"));
-			}
-			if (from.hasTriggerSensors() && !opp.hasTriggerSensors()) {
-				if (debugTransitions) {
-					Serial.println(F("Checking past sensors"));
-				}
-				if (!dirSensorTimeout(false)) {
-					if (debugTransitions) {
-						Serial.println(F("* Still In Timeout"));
-					}
-					return;
-				}
-			}
-			switchStatus(armed, opp);
-			return;
-		}
-	}
-	if (from.hasSensor(sensor)) {
-		if (from.isPrimedExit()) {
-			direction = reversed();
-			switchStatus(armed, from);
-		} else if (from.occupied()) {
-			if (debugTransitions) {
-				Serial.println(F("Turned back"));
-			}
-			direction = reversed();
-			switchStatus(armed, from);
-			switchStatus(exiting, from);
-			return;
-		}
-	}
+void actionArmed(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.direction = st.directionTo(*c.ep);
+	st.markDirSensor(true);
+	switchRelay(st.toEdge().relay, st.toEdge().relayTriggerState);
 }
 
-boolean LoopState::maybeCoreAbandoned(int sensor) {
-	const LoopDef& d = def();
-	if (d.core.isPrimed()) {
-		return false;
-	}
-	if (d.left.occupied()) {
-		if (!d.right.occupied()) {
-			direction = left;
-			if (debugTransitions) {
-				Serial.println(F("Core abandoned going left"));
-			}
-			switchStatus(exited, d.left);
-			return true;
-		}
-	} else if (d.right.occupied()) {
-		direction = left;
-		if (debugTransitions) {
-			Serial.println(F("Core abandoned going right"));
-		}
-		switchStatus(exited, d.right);
-		return true;
-	}
-	if (debugTransitions) {
-		Serial.println(F("Disappeared ! Running timeout."));
+void actionMoving(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.leftSensorTime = st.rightSensorTime = 0;
+	st.direction = st.directionFrom(*c.ep);
+	if (c.oldStatus == entering) {
+		st.markDirSensor(false);
 	}
-	timeout = millis();
-	return true;
 }
 
-void LoopState::switchRelayTo(const Endpoint& exitVia) {
-	if (exitVia.relay > 0) {
-		switchRelay(exitVia.relay, exitVia.relayTriggerState);
-		return;
+void actionFreeRelay(LoopState& st, const LoopDef& d, const TransitionContext& c) {
+	st.maybeFreeRelay(*c.ep);
+}
+
+enum TransitionActionId {
+	aNone,
+	aDirLeft,
+	aDirRight,
+	aReverse,
+	aDirFromTarget,
+	aRunTimeout,
+	aMarkIn,
+	aMarkOut,
+	aLogReversed,
+	aRevertRelay,
+	aRelaysOff,
+	aReadyEnter,
+	aArmed,
+	aMoving,
+	aFreeRelay
+};
+
+const TransitionAction actions[] PROGMEM = {
+	&actionNone,
+	&actionDirLeft,
+	&actionDirRight,
+	&actionReverse,
+	&actionDirFromTarget,
+	&actionRunTimeout,
+	&actionMarkIn,
+	&actionMarkOut,
+	&actionLogReversed,
+	&actionRevertRelay,
+	&actionRelaysOff,
+	&actionReadyEnter,
+	&actionArmed,
+	&actionMoving,
+	&actionFreeRelay
+};
+
+const char actionNames[] PROGMEM =
+	"-\0dirLeft\0dirRight\0reverse\0dirFromTarget\0runTimeout\0markIn\0markOut\0"
+	"logReversed\0revertRelay\0relaysOff\0readyEnter\0armed\0moving\0freeRelay";
+
+const char targetNames[] PROGMEM = "param\0opposite\0left\0right\0fromEdge";
+
+/**
+ * Evaluated when a sensor of the loop changes. 'param' is fromEdge() for approach .. moving,
+ * toEdge() for armed .. exited.
+ */
+const Transition sensorTransitions[] PROGMEM = {
+	// IDLE: left / right primed => approach, core appeared with no left or right => occupied
+	{ when(idle), gColdBootOccupied, aNone, occupied, tStop, toLeft },
+	{ when(idle), gColdBootLeft, aDirLeft, armed, exiting, toLeft },
+	{ when(idle), gColdBootRight, aDirRight, armed, exiting, toRight },
+	{ when(idle), gEnterLeft, aDirRight, approach, tStop, toLeft },
+	{ when(idle), gEnterRight, aDirLeft, approach, tStop, toRight },
+
+	{ when(occupied), gLeftExitEmpty, aDirLeft, moving, tStop, toRight },
+	{ when(occupied), gLeftExit, aDirLeft, exiting, tStop, toLeft },
+	{ when(occupied), gRightExitEmpty, aDirRight, moving, tStop, toLeft },
+	{ when(occupied), gRightExit, aDirRight, exiting, tStop, toRight },
+	{ when(occupied), gTracksEmpty, aNone, idle, tStop, toLeft },
+	{ when(occupied), gCoreOccupied, aNone, tKeep, tStop, toParam },
+	{ when(occupied), gLeftOccupied, aDirLeft, exited, tStop, toLeft },
+	{ when(occupied), gRightOccupied, aDirRight, exited, tStop, toRight },
+
+	// left the edge with the core empty: idle, but the core sensor may still move the train in
+	{ when(approach) | when(readyEnter), gVacatedCorePrimed, aNone, moving, tStop, toParam },
+	{ when(approach) | when(readyEnter), gVacated, aNone, idle, tResume, toParam },
+	{ when(approach) | when(readyEnter), gCorePartiallyEntered, aNone, entering, tStop, toParam },
+	{ when(approach) | when(readyEnter), gCoreSensorPrimed, aNone, moving, tStop, toParam },
+	{ when(approach) | when(readyEnter), gCoreSensor, aNone, tKeep, tStop, toParam },
+	{ when(approach) | when(readyEnter), gApproachPrimed, aNone, readyEnter, tStop, toParam },
+
+	{ when(entering), gMovedToCentre, aNone, moving, tStop, toParam },
+	{ when(entering), gMovingReverse, aReverse, exited, tStop, toOpposite },
+
+	{ when(moving) | when(armed), gCoreLeftOnly, aDirLeft, exited, tStop, toLeft },
+	{ when(moving) | when(armed), gCoreRightOnly, aDirLeft, exited, tStop, toRight },
+	{ when(moving) | when(armed), gCoreAbandoned, aRunTimeout, tKeep, tStop, toParam },
+
+	{ when(moving), gExitAwaitsIn, aNone, tKeep, tStop, toParam },
+	{ when(moving), gExitPrimed, aNone, armed, tStop, toOpposite },
+	{ when(moving), gTurnPrimed, aReverse, armed, tStop, toParam },
+	{ when(moving), gTurnedBack, aReverse, armed, exiting, toParam },
+
+	{ when(armed), gArmedUnrelated, aNone, tKeep, tStop, toParam },
+	{ when(armed), gReversedWhileArmed, aLogReversed, tKeep, tResume, toParam },
+	{ when(armed), gExitEntered, aNone, exiting, tStop, toParam },
+	// still moving in the _SAME_ direction; exit became invalid for some reason.
+	{ when(armed), gExitInvalid, aRevertRelay, moving, tStop, toParam },
+
+	{ when(exiting), gOutSensorsActive, aMarkOut, tKeep, tStop, toParam },
+	{ when(exiting), gOutTimeoutPending, aNone, tKeep, tStop, toParam },
+	{ when(exiting), gCoreAbandoned, aNone, exited, tStop, toParam },
+	// moving takes "from" as parameter, so 'via' will revers direction
+	{ when(exiting), gVacated, aNone, moving, tStop, toParam },
+
+	{ when(exited), gCoreReentered, aReverse, entering, tStop, toParam },
+	{ when(exited), gVacated, aNone, idle, tStop, toParam },
+	{ when(exited), gInSensorFired, aDirFromTarget, approach, tStop, toParam },
+};
+
+/**
+ * Evaluated when a state is entered; 'param' is the endpoint passed to switchStatus().
+ */
+const Transition entryTransitions[] PROGMEM = {
+	{ when(idle), gAlways, aRelaysOff, tKeep, tResume, toParam },
+	{ when(idle), gOppositePrimedEnter, aDirFromTarget, approach, tStop, toOpposite },
+
+	{ when(approach), gFromEdgePrimedEnter, aNone, readyEnter, tStop, toFromEdge },
+
+	{ when(readyEnter), gAlways, aReadyEnter, tKeep, tStop, toParam },
+
+	// moving arms towards the opposite endpoint
+	{ when(moving), gAlways, aMoving, tKeep, tResume, toParam },
+	{ when(moving), gCoreEmpty, aNone, idle, tStop, toOpposite },
+	{ when(moving), gExitNotReady, aNone, tKeep, tStop, toParam },
+	{ when(moving), gInSensorsActive, aMarkIn, tKeep, tStop, toParam },
+	{ when(moving), gInTimeoutPending, aNone, tKeep, tStop, toParam },
+	{ when(moving), gExitOutInactive, aNone, tKeep, tStop, toParam },
+	{ when(moving), gExitDirectionPrimed, aNone, armed, tStop, toOpposite },
+
+	{ when(armed), gAlways, aArmed, tKeep, tStop, toParam },
+
+	{ when(exited), gAlways, aFreeRelay, tKeep, tStop, toParam },
+};
+
+const byte sensorTransitionCount = sizeof(sensorTransitions) / sizeof(Transition);
+const byte entryTransitionCount = sizeof(entryTransitions) / sizeof(Transition);
+
+/**
+ * Longest chain of automatic transitions: moving -> idle -> approach -> readyEnter.
+ */
+const byte maxEnteredStates = 4;
+
+void printTransitionName(const char* names, byte index) {
+	while (index-- > 0) {
+		names += strlen_P(names) + 1;
 	}
-	const Endpoint& opp = def().opposite(exitVia);
-	if (opp.relay > 0) {
-		switchRelay(opp.relay, !opp.relayTriggerState);
+	Serial.print((const __FlashStringHelper*)names);
+}
+
+const Endpoint* transitionTarget(const LoopState& st, const LoopDef& d, const TransitionContext& c, byte target) {
+	switch (target) {
+		case toOpposite:	return &d.opposite(*c.ep);
+		case toLeft:		return &d.left;
+		case toRight:		return &d.right;
+		case toFromEdge:	return &st.fromEdge();
 	}
+	return c.ep;
 }
 
-void LoopState::processArmed(int sensor, const Endpoint& to) {
-	const LoopDef& d = def();
-	const Endpoint& from = d.opposite(to);
+/**
+ * Evaluates the rows of 'table' applying to 'states', starting at 'row'. Runs the actions of
+ * the rows whose guards hold until a row switches the state or stops the evaluation. Returns
+ * the index of the switching row, copied to 't', with c.target set; 'count' if there is none.
+ */
+byte evaluateTransitions(LoopState& st, const Transition* table, byte count, byte row,
+		unsigned int states, TransitionContext& c, Transition& t) {
+	const LoopDef& d = st.def();
 
-	if (maybeCoreAbandoned(sensor)) {
-		return;
-	}
-	boolean revert = false;
-	if (!to.hasSensor(sensor)) {
-		if (from.sensorOut == sensor) {
-			if (logTransitions) {
-				Serial.print(F("Train reversed while armed for ")); Serial.println(direction == left ? "left" : "right");
-			}
-			revert = true;
+	for (; row < count; row++) {
+		memcpy_P(&t, table + row, sizeof(Transition));
+		if ((t.states & states) == 0) {
+			continue;
 		}
-		if (!revert) {
-			return;
+		TransitionGuard guard = (TransitionGuard)pgm_read_ptr(&guards[t.guard]);
+		if (!guard(st, d, c)) {
+			continue;
 		}
-	}
-	if (to.changedOccupied(sensor, true)) {
-		switchStatus(exiting, to);
-		return;
-	}
-	if (to.isValidExit()) {
-		if (to.hasTriggerSensors() && dirSensorTimeout(true)) {
-			if (debugTransitions) {
-				Serial.println(F("Trigger sensor timeout"));
-			}
-			revert = true;
-		}
-	}
-	if (!to.isPrimedExit()) {
 		if (debugTransitions) {
-			Serial.println(F("Exit became invalid"));
+			Serial.print(F("Transition ")); Serial.print(row); Serial.print(' ');
+			printTransitionName(guardNames, t.guard); Serial.println();
+		}
+		c.target = transitionTarget(st, d, c, t.target);
+		TransitionAction action = (TransitionAction)pgm_read_ptr(&actions[t.action]);
+		action(st, d, c);
+		if (t.next != tKeep) {
+			return row;
+		}
+		if (t.after != tResume) {
+			break;
 		}
-		revert = true;
 	}
+	return count;
+}
 
-	if (revert) {
-		if (to.sensorOut > 0) {
-			// exit has safety sensor, no need to change direction
-			if (from.sensorOut == 0) {
-				// but the opposite has no sensor; flip the relay just in case.
-				switchRelayTo(from);
-				if (debugTransitions) {
-					Serial.println(F("Relay switched to opposite"));
+void dumpTransitionTable(char table, const Transition* rows, byte count) {
+	Transition t;
+	for (byte i = 0; i < count; i++) {
+		memcpy_P(&t, rows + i, sizeof(Transition));
+		Serial.print(table); Serial.print(i); Serial.print(',');
+		boolean first = true;
+		for (int s = idle; s <= occupied; s++) {
+			if (t.states & when(s)) {
+				if (!first) {
+					Serial.print('|');
 				}
+				Serial.print(statName((Status)s));
+				first = false;
 			}
-			switchStatus(moving, to);
-			return;
 		}
-
-		// still moving in the _SAME_ direction; exit became invalid for
-		// some reason. Heading to the exit, but just in case turn off the relay.
-		switchStatus(moving, to);
+		Serial.print(',');
+		printTransitionName(guardNames, t.guard); Serial.print(',');
+		printTransitionName(actionNames, t.action); Serial.print(',');
+		if (t.next == tKeep) {
+			Serial.print('-');
+		} else {
+			Serial.print(statName((Status)t.next));
+		}
+		Serial.print(',');
+		if (t.after == tStop) {
+			Serial.print('-');
+		} else if (t.after == tResume) {
+			Serial.print(F("resume"));
+		} else {
+			Serial.print(statName((Status)t.after));
+		}
+		Serial.print(',');
+		printTransitionName(targetNames, t.target);
+		Serial.println();
 	}
 }
 
-void LoopState::processExiting(int sensor, const Endpoint& via) {
-	const LoopDef& d = def();
-	if (!d.core.isPrimed()) {
-		if (via.hasTriggerSensors()) {
-			if (debugTransitions) {
-				Serial.println(F("Exit has trigger sensors"));
-			}
-			if (via.sensorsActive()) {
-				if (debugTransitions) {
-					Serial.println(F("* Out sensor still active"));
-				}
-				markDirSensor(true);
-				return;
-			} else if (!dirSensorTimeout(true)) {
-				if (debugTransitions) {
-					Serial.println(F("* In Out timeout"));
-				}
-				return;
+void dumpTransitions() {
+	Serial.println(F("row,states,guard,action,next,after,via"));
+	dumpTransitionTable('C', sensorTransitions, sensorTransitionCount);
+	dumpTransitionTable('E', entryTransitions, entryTransitionCount);
+}
+
+void LoopState::maybeFreeRelay(const Endpoint& via) {
+	if (via.sensorIn > 0) {
+		const Endpoint &opp = def().opposite(via);
+		if ((opp.sensorIn == 0) && (opp.relay > 0)) {
+			if (logTransitions) {
+				Serial.print(F("Opposite has no sensor, conservative switch to opposite"));
 			}
+			switchRelayTo(opp);
 		}
-		switchStatus(exited, via);
-		return;
-	}
-	if (via.hasSensor(sensor) && via.changedOccupied(sensor, false)) {
-		// moving takes "from" as parameter, so 'via' will revers direction
-		switchStatus(moving, via);
-		return;
 	}
 }
 
-void LoopState::processExited(int sensor, const Endpoint& via) {
-	const LoopDef& d = def();
-	if (d.core.hasSensor(sensor) && d.core.isPrimed()) {
-		direction = reversed();
-		switchStatus(entering, via);
-		return;
-	}
-	if (via.hasSensor(sensor) && via.changedOccupied(sensor, false)) {
-		switchStatus(idle, via);
-		return;
+/**
+ * Enters the state, then follows the automatic transitions of entryTransitions.
+ */
+void LoopState::switchStatus(Status s, const Endpoint& ep) {
+	TransitionContext c = { 0, &ep, &ep, status };
+	Transition t;
+	byte entered = 0;
+
+	while (true) {
+		c.oldStatus = status;
+		status = s;
+		if (logTransitions) {
+			Serial.print('#'); Serial.print(id() + 1);
+			Serial.print(F(": Change status: ")); Serial.print(statName(c.oldStatus)); Serial.print(F(" => ")); Serial.print(statName(s));
+			Serial.print(F(", Direction: ")); Serial.println(direction ? F("left") : F("right"));
+		}
+		entered++;
+		byte row = evaluateTransitions(*this, entryTransitions, entryTransitionCount, 0, when(s), c, t);
+		if (row >= entryTransitionCount) {
+			break;
+		}
+		if (entered >= maxEnteredStates) {
+			Serial.println(F("*Transition chain too long"));
+			break;
+		}
+		s = (Status)t.next;
+		c.ep = c.target;
 	}
-	if (via.sensorIn == sensor) {
-		if (readS88(via.sensorIn) != via.invertInSensor) {
-			direction = directionFrom(via);
-			switchStatus(approach, via);
-			return;
+	// each entered state clears the sensors if the chain ended in idle
+	while (entered-- > 0) {
+		if (status == idle) {
+			if (logTransitions) {
+				Serial.println(F("Clearing trigger sensors"));
+			}
+			outageStart = 0;
+			leftSensorTime = rightSensorTime = 0;
 		}
 	}
 }
 
-void LoopState::processOccupied(int sensor, boolean s) {
-	const LoopDef& d = def();
-
-	if (d.left.hasSensor(sensor) && d.left.isPrimedExit()) {
-		direction = left;
-		if (d.left.occupiedTrackSensors() == 0) {
-			switchStatus(moving, /* from */ d.right);
-		} else {
-			switchStatus(exiting, d.left);
-		}
-		return;
+boolean LoopState::dirSensorTimeout(boolean moveOut) const {
+	const Endpoint ep = moveOut ? toEdge() : fromEdge();
+	if (!ep.hasTriggerSensors()) {
+		return true;
 	}
-	if (d.right.hasSensor(sensor) && d.right.isPrimedExit()) {
-		direction = right;
-		if (d.right.occupiedTrackSensors() == 0) {
-			switchStatus(moving, /* from */ d.left);
-		} else {
-			switchStatus(exiting, d.right);
+	if (ep.sensorsActive()) {
+		if (debugTransitions) {
+			Serial.println(F("Sensors still active"));
 		}
-		return;
+		return false;
 	}
-
-	if (d.occupiedTrackSensors() == 0) {
-		switchStatus(idle, d.left);
-		return;
+	long dst = dirSensorTime(moveOut);
+	if (dst == 0) {
+		return true;
 	}
-	if (d.core.occupied()) {
-		return;
+	long d = millis() - dst;
+	if (debugTransitions) {
+		Serial.print(F("Sensor diff: ")); Serial.println(d);
 	}
-	if (d.left.hasSensor(sensor) && d.left.occupied()) {
-		direction = left;
-		switchStatus(exited, d.left);
+	return d > def().sensorTimeout;
+}
+
+void LoopState::switchRelayTo(const Endpoint& exitVia) {
+	if (exitVia.relay > 0) {
+		switchRelay(exitVia.relay, exitVia.relayTriggerState);
 		return;
 	}
-	if (d.right.hasSensor(sensor) && d.right.occupied()) {
-		direction = right;
-		switchStatus(exited, d.right);
-		return;
+	const Endpoint& opp = def().opposite(exitVia);
+	if (opp.relay > 0) {
+		switchRelay(opp.relay, !opp.relayTriggerState);
 	}
 }
 
@@ -612,7 +845,7 @@ void LoopState::handleOutage() {
 
 	if ((status == approach || status == exited)) {
 		threshold = outageAproachExitTimeout;
-	} else if (status == readyEnter && (!fromEdge().hasTriggerSensors() || !fromEdge().isPrimedEnter())) {
+	} else if (status == readyEnter && (!fromEdge().hasTriggerSensors() || !fromEdge().test(epPrimedEnter))) {
 		threshold = outageAproachExitTimeout;
 	} else {
 		threshold = outageTimeout;
@@ -627,7 +860,7 @@ void LoopState::handleOutage() {
 	}
 }
 
-void LoopState::processChange(int sensor, boolean s) {
+void LoopState::processChange(slotmask_t changed) {
 	const LoopDef& d = def();
 
 	if (!d.active) {
@@ -659,7 +892,7 @@ void LoopState::processChange(int sensor, boolean s) {
 			if (outageStart == 0) {
 				Serial.print('#'); Serial.print(id() + 1);
 				Serial.println(F(": Outage start"));
-				outageStart = millis();
+				outageStart = loopMillis();
 				return;
 			}
 			handleOutage();
@@ -668,45 +901,24 @@ void LoopState::processChange(int sensor, boolean s) {
 	}
 	if (debugTransitions) {
 		Serial.print(F("Processing: ")); Serial.print(id() + 1);
-		Serial.print(F(" Changed sensor: ")); Serial.println(sensor);
+		Serial.print(F(" Changed sensors:"));
+		for (slotmask_t rest = changed; rest; rest &= rest - 1) {
+			Serial.print(' '); Serial.print(sensors.sensorId[__builtin_ctzl(rest)]);
+		}
+		Serial.println();
 	}
-	switch (status) {
-		case idle:
-			processIdle(sensor);
-			break;
-
-		case occupied:
-			processOccupied(sensor, s);
-			break;
-
-		case approach:
-			processApproach(sensor, fromEdge());
-			break;
-
-		case readyEnter:
-			processReadyEnter(sensor, fromEdge());
-			break;
-
-		case entering:
-			processEntering(sensor, fromEdge());
-			break;
-
-		case moving:
-			processMoving(sensor, fromEdge());
-			break;
-
-		case armed:
-			processArmed(sensor, toEdge());
-			break;
-
-		case exiting:
-			processExiting(sensor, toEdge());
-			break;
-
-		case exited:
-			processExited(sensor, toEdge());
-			break;
-
+	TransitionContext c = { changed, (status >= armed && status <= exited) ? &toEdge() : &fromEdge(), NULL, status };
+	unsigned int states = when(status);
+	Transition t;
+	for (byte row = 0; (row = evaluateTransitions(*this, sensorTransitions, sensorTransitionCount, row, states, c, t)) < sensorTransitionCount; row++) {
+		switchStatus((Status)t.next, *c.target);
+		if (t.after == tResume) {
+			continue;
+		}
+		if (t.after != tStop) {
+			switchStatus((Status)t.after, *c.target);
+		}
+		break;
 	}
 
 	// keep sensor timeouts:
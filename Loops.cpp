@@ -11,18 +11,93 @@
 #include "Loops.h"
 #include "S88.h"
 #include "Utils.h"
+#include "FastIO.h"
 
 extern boolean logTransitions;
 
 LoopDef	loopDefinitions[maxLoopCount];
 LoopState loopStates[maxLoopCount];
-int relayPins[maxRelayCount] = {
+/**
+ * Relay pins, for pinMode(); writeRelayPin() writes them through FastPin.
+ */
+const int relayPins[] = {
 	RELAY_1, RELAY_2, RELAY_3, RELAY_4
 };
+static_assert(sizeof(relayPins) / sizeof(relayPins[0]) == maxRelayCount, "relayPins must list every relay");
 boolean relayStates[maxRelayCount] = {};
 
 int loopCount = 0;
 
+/**
+ * Loops referencing the sensor in each sensor table slot, bit 'i' = loop 'i'. Rebuilt
+ * whenever the loop definitions or the sensor slots change.
+ */
+loopmask_t sensorLoops[maxSensorCount];
+
+/**
+ * The loop being indexed by indexLoopSensor().
+ */
+byte indexedLoop;
+
+int indexLoopSensor(int sensor, boolean type) {
+	int slot = findSensor(sensor);
+	if (slot >= 0) {
+		sensorLoops[slot] |= 1 << indexedLoop;
+	}
+	return 0;
+}
+
+/**
+ * Sensor states seen by the loops during a processing pass.
+ */
+slotmask_t sensorSnapshot = 0;
+boolean sensorSnapshotTaken = false;
+
+void takeSensorSnapshot() {
+	sensorSnapshot = s88EventSnapshot();
+	sensorSnapshotTaken = true;
+}
+
+void releaseSensorSnapshot() {
+	sensorSnapshotTaken = false;
+}
+
+boolean readSensor(int sensor) {
+	return sensorSnapshotTaken ? readS88(sensorSnapshot, sensor) : readS88(sensor);
+}
+
+/**
+ * Millis of the sensor change being processed, 0 when not processing one.
+ */
+long sensorChangeMillis = 0;
+
+long loopMillis() {
+	return sensorChangeMillis != 0 ? sensorChangeMillis : millis();
+}
+
+#ifdef __loop_compiled_predicates
+/**
+ * Compiled predicates of the left and right endpoint of each loop.
+ */
+EndpointMasks endpointMasks[maxLoopCount][2];
+#endif
+
+void rebuildSensorLoops() {
+	memset(sensorLoops, 0, sizeof(sensorLoops));
+	for (indexedLoop = 0; indexedLoop < maxLoopCount; indexedLoop++) {
+		const LoopDef& def = loopDefinitions[indexedLoop];
+#ifdef __loop_compiled_predicates
+		def.left.compile(endpointMasks[indexedLoop][0]);
+		def.right.compile(endpointMasks[indexedLoop][1]);
+#endif
+		// a cleared loop keeps its definition, but must not be woken up
+		if (!def.active) {
+			continue;
+		}
+		def.forSensors(&indexLoopSensor);
+	}
+}
+
 long timeDiff(long time) {
 	if (time == 0) {
 		return 0;
@@ -34,9 +109,6 @@ boolean defineLoop(int id, const LoopDef& edited) {
 	if (id < 0 || id >= maxLoopCount) {
 		return false;
 	}
-	if (id >= maxLoopCount) {
-		return false;
-	}
 	loopDefinitions[id] = edited;
 	loopDefinitions[id].active = true;
 	loopDefinitions[id].defineSensors();
@@ -80,7 +152,10 @@ int freeUnusedSingleSensor(int sensor, boolean type) {
 }
 
 int freeUnusedSensors() {
-	return forSensors(&freeUnusedSingleSensor);
+	int cnt = forSensors(&freeUnusedSingleSensor);
+	// also picks up the sensors of a just defined loop
+	rebuildSensorLoops();
+	return cnt;
 }
 
 void clearLoop(int id) {
@@ -88,6 +163,7 @@ void clearLoop(int id) {
 		return;
 	}
 	loopDefinitions[id].active = false;
+	rebuildSensorLoops();
 }
 
 void printSensorAndState(const String& name, int sensor, boolean invert, boolean nl) {
@@ -124,11 +200,11 @@ void printSensorAndState(const String& name, int sensor, boolean invert) {
 }
 
 boolean Endpoint::stateA() const {
-	return (sensorA > 0) && (readS88(sensorA) != invertA);
+	return (sensorA > 0) && (readSensor(sensorA) != invertA);
 }
 
 boolean Endpoint::stateB() const {
-	return (sensorB > 0) && (readS88(sensorB) != invertB);
+	return (sensorB > 0) && (readSensor(sensorB) != invertB);
 }
 
 void Endpoint::printState() const {
@@ -253,10 +329,10 @@ boolean LoopCore::hasChanged() const {
 boolean LoopCore::occupied() const {
 	boolean occ = false;
 	if (trackA > 0) {
-		occ = readS88(trackA) != invertA;
+		occ = readSensor(trackA) != invertA;
 	}
 	if (trackB > 0) {
-		occ = readS88(trackB) != invertB;
+		occ = readSensor(trackB) != invertB;
 	}
 	return occ;
 }
@@ -267,8 +343,8 @@ boolean LoopCore::isDirectionPrimed(boolean left) const {
 	} else if (trackA == 0) {
 		return false;
 	}
-	boolean sa = readS88(trackA) != invertA;
-	boolean sb = readS88(trackB) != invertB;
+	boolean sa = readSensor(trackA) != invertA;
+	boolean sb = readSensor(trackB) != invertB;
 	if (sa == 0 && sb == 0) {
 		return false;
 	}
@@ -349,12 +425,12 @@ boolean Endpoint::isPrimedEnter() const{
 		return false;
 	}
 	if (sensorIn > 0) {
-		boolean ss = readS88(sensorIn) != invertInSensor;
+		boolean ss = readSensor(sensorIn) != invertInSensor;
 		return ss;
 	}
 	if (switchOrSensor > 0 && !useSwitch) {
 		// for "primed", the sensor must be active.
-		boolean ss = readS88(switchOrSensor) != invertSensor;
+		boolean ss = readSensor(switchOrSensor) != invertSensor;
 		return ss;
 	}
 	// XXX check
@@ -374,10 +450,10 @@ boolean Endpoint::sensorsActive() const {
 	}
 	boolean active = false;
 	if (sensorIn > 0) {
-		active = readS88(sensorIn) != invertInSensor;
+		active = readSensor(sensorIn) != invertInSensor;
 	}
 	if ((sensorOut > 0) && (sensorIn != sensorOut)) {
-		active |= readS88(sensorOut) != invertInSensor;
+		active |= readSensor(sensorOut) != invertInSensor;
 	}
 	return active;
 }
@@ -400,10 +476,10 @@ boolean Endpoint::isFullyEntered(LoopState& s) const {
 	}
 	boolean active = false;
 	if (sensorIn > 0) {
-		active = readS88(sensorIn) == invertInSensor;
+		active = readSensor(sensorIn) == invertInSensor;
 	}
 	if ((sensorOut > 0) && (sensorIn != sensorOut)) {
-		active |= (readS88(sensorOut) == invertOutSensor);
+		active |= (readSensor(sensorOut) == invertOutSensor);
 	}
 	if (active) {
 		return false;
@@ -422,11 +498,11 @@ boolean Endpoint::isFullyEntered(LoopState& s) const {
 
 boolean Endpoint::isValidEnter() const {
 	if (sensorA > 0 && sensorB > 0) {
-		boolean stateA = readS88(sensorA);
-		boolean stateB = readS88(sensorB);
+		boolean stateA = readSensor(sensorA);
+		boolean stateB = readSensor(sensorB);
 
 		if (shortTrack > 0) {
-			boolean state = readS88(shortTrack) != invertShortTrack;
+			boolean state = readSensor(shortTrack) != invertShortTrack;
 			if (debugLoops) {
 				Serial.print(F("Two enter tracks + short track: "));
 				Serial.print(shortTrack); Serial.print(F("=")); Serial.println(state);
@@ -443,7 +519,7 @@ boolean Endpoint::isValidEnter() const {
 		}
 		if (useSwitch && switchOrSensor > 0) {
 			// Tracks join at turnout whose position is detected. Count the turnout position in:
-			boolean switchState = readS88(switchOrSensor) != invertSensor;
+			boolean switchState = readSensor(switchOrSensor) != invertSensor;
 			Serial.print(F("Selecting: ")); Serial.println(switchState ? sensorA : sensorB);
 			if (switchState) {
 				return stateB;
@@ -453,19 +529,19 @@ boolean Endpoint::isValidEnter() const {
 		}
 		if (switchOrSensor > 0) {
 			// two tracks, with a common sensor. Trigger if either of the tracks is active + the sensor is.
-			boolean switchState = readS88(switchOrSensor) != invertSensor;
+			boolean switchState = readSensor(switchOrSensor) != invertSensor;
 			Serial.print(F("Sensor: ")); Serial.println(switchState);
 			return (stateA || stateB) && (switchState);
 		}
 		// just two tracks that join, no other trigger.
 		return stateA || stateB;
 	}
-	boolean stateA = readS88(sensorA) != invertA;
+	boolean stateA = readSensor(sensorA) != invertA;
 	if (debugLoops) {
 		Serial.print(F("Single track: ")); Serial.print(sensorA); Serial.print(F("=")); Serial.println(stateA);
 	}
 	if (shortTrack > 0) {
-		boolean state = readS88(shortTrack) != invertShortTrack;
+		boolean state = readSensor(shortTrack) != invertShortTrack;
 		if (debugLoops) {
 			Serial.print(F("Short track: "));
 			Serial.print(shortTrack); Serial.print(F("=")); Serial.println(state);
@@ -476,7 +552,7 @@ boolean Endpoint::isValidEnter() const {
 		return false;
 	}
 	if (turnout > 0) {
-		boolean ss = readS88(turnout) != invertTurnout;
+		boolean ss = readSensor(turnout) != invertTurnout;
 		if (debugLoops) {
 			Serial.print(F("Switched: ")); Serial.println(ss);
 		}
@@ -488,7 +564,7 @@ boolean Endpoint::isValidEnter() const {
 		return true;
 	}
 	if (switchOrSensor > 0) {
-		boolean ss = readS88(switchOrSensor) != invertSensor;
+		boolean ss = readSensor(switchOrSensor) != invertSensor;
 		if (debugLoops) {
 			Serial.print(F("Switched: ")); Serial.println(ss);
 		}
@@ -511,7 +587,7 @@ int Endpoint::selectedExitTrack() const {
 		inv = invertSensor;
 	}
 	if ((sensorA > 0) && (sensorB > 0) && (tnt > 0)) {
-		boolean switchState = readS88(tnt);
+		boolean switchState = readSensor(tnt);
 		if (switchState != inv) {
 			exitTrack = sensorB;
 		} else {
@@ -526,7 +602,7 @@ int Endpoint::selectedExitTrack() const {
 		Serial.print(F("Checking track: ")); Serial.println(exitTrack);
 	}
 	if (sensorB == 0 && (tnt > 0)) {
-		boolean switchState = readS88(tnt);
+		boolean switchState = readSensor(tnt);
 		if (!(switchState != inv)) {
 			// turnout in wrong direction
 			if (debugLoops) {
@@ -543,30 +619,36 @@ boolean Endpoint::occupied() const {
 	if (trackSensor < 1) {
 		return false;
 	}
-	if (readS88(trackSensor)) {
+	if (readSensor(trackSensor)) {
 		return true;
 	}
-	return shortTrack > 0 && readS88(shortTrack);
+	return shortTrack > 0 && readSensor(shortTrack);
+}
+
+boolean Endpoint::hasSensorIn(slotmask_t changed) const {
+	return sensorInSet(changed, sensorA) || sensorInSet(changed, sensorB) || sensorInSet(changed, switchOrSensor) ||
+		   sensorInSet(changed, turnout) || sensorInSet(changed, sensorIn) || sensorInSet(changed, sensorOut) ||
+		   sensorInSet(changed, shortTrack);
 }
 
-boolean Endpoint::changedOccupied(int sensor, boolean occupied) const {
+boolean Endpoint::changedOccupied(slotmask_t changed, boolean occupied) const {
 	int trackSensor = selectedExitTrack();
-	if (turnout > 0 && (sensor == turnout)) {
+	if (turnout > 0 && sensorInSet(changed, turnout)) {
 		if ((trackSensor < 1) && !occupied) {
 			return true;
 		}
 	}
-	if (useSwitch && (sensor == switchOrSensor)) {
+	if (useSwitch && sensorInSet(changed, switchOrSensor)) {
 		if ((trackSensor < 1) && !occupied) {
 			return true;
 		}
 	}
-	if ((trackSensor != sensor) && (shortTrack != sensor)) {
+	if (!sensorInSet(changed, trackSensor) && !sensorInSet(changed, shortTrack)) {
 		return false;
 	}
-	boolean s = readS88(trackSensor);
+	boolean s = readSensor(trackSensor);
 	if (shortTrack > 0) {
-		s |= readS88(shortTrack);
+		s |= readSensor(shortTrack);
 	}
 	return s == occupied;
 }
@@ -578,9 +660,9 @@ boolean Endpoint::isValidExit() const {
 		return false;
 	}
 	if (exitTrack > 0) {
-		boolean s = readS88(exitTrack);
+		boolean s = readSensor(exitTrack);
 		if (shortTrack > 0) {
-			s = readS88(shortTrack);
+			s = readSensor(shortTrack);
 		}
 		if (s) {
 			if (debugLoops) {
@@ -600,14 +682,14 @@ boolean Endpoint::isPrimedExit() const {
 		return false;
 	}
 	if (sensorOut > 0) {
-		boolean v = readS88(sensorOut) != invertOutSensor;
+		boolean v = readSensor(sensorOut) != invertOutSensor;
 		if (debugLoops) {
 			Serial.print(F("Exit sensor: ")); Serial.println(v);
 		}
 		return v;
 	}
 	if (!useSwitch && (switchOrSensor > 0)) {
-		boolean v = readS88(switchOrSensor) != invertSensor;
+		boolean v = readSensor(switchOrSensor) != invertSensor;
 		if (debugLoops) {
 			Serial.print(F("Exit sensor: ")); Serial.println(v);
 		}
@@ -622,15 +704,209 @@ boolean Endpoint::isPrimedExit() const {
 	}
 }
 
+#ifdef __loop_compiled_predicates
+const MaskTerm alwaysTerm = { 0, 0 };
+const MaskTerm neverTerm = { 0, 1 };
+
+inline MaskTerm roleTerm(byte role, boolean state) {
+	MaskTerm t = { (byte)(1 << role), (byte)(state ? 1 << role : 0) };
+	return t;
+}
+
+/**
+ * Both terms must hold; contradicting terms never do.
+ */
+MaskTerm bothTerms(MaskTerm a, MaskTerm b) {
+	if (((a.value ^ b.value) & a.mask & b.mask) || ((a.value & ~a.mask) | (b.value & ~b.mask))) {
+		return neverTerm;
+	}
+	MaskTerm t = { (byte)(a.mask | b.mask), (byte)(a.value | b.value) };
+	return t;
+}
+
+byte Endpoint::roleBits(slotmask_t snapshot) const {
+	byte bits = 0;
+	if (readS88(snapshot, sensorA)) bits |= 1 << roleA;
+	if (readS88(snapshot, sensorB)) bits |= 1 << roleB;
+	if (readS88(snapshot, turnout)) bits |= 1 << roleTurnout;
+	if (readS88(snapshot, sensorIn)) bits |= 1 << roleIn;
+	if (readS88(snapshot, sensorOut)) bits |= 1 << roleOut;
+	if (readS88(snapshot, shortTrack)) bits |= 1 << roleShort;
+	if (readS88(snapshot, switchOrSensor)) bits |= 1 << roleSwitch;
+	return bits;
+}
+
+/**
+ * Translates the reference predicates into terms, branch by branch, including their quirks:
+ * two enter tracks are read without the invert flags, and isValidExit() tests just the short
+ * track if there is one.
+ */
+void Endpoint::compile(EndpointMasks& m) const {
+	for (byte i = 0; i < EndpointMasks::termCount; i++) {
+		m.terms[i] = neverTerm;
+	}
+
+	// isValidEnter()
+	MaskTerm* t = m.terms + EndpointMasks::validEnterTerms;
+	if (sensorA > 0 && sensorB > 0) {
+		if (shortTrack > 0) {
+			*t++ = roleTerm(roleShort, !invertShortTrack);
+		}
+		if (useSwitch && switchOrSensor > 0) {
+			*t++ = bothTerms(roleTerm(roleSwitch, !invertSensor), roleTerm(roleB, true));
+			*t++ = bothTerms(roleTerm(roleSwitch, invertSensor), roleTerm(roleA, true));
+		} else if (switchOrSensor > 0) {
+			MaskTerm sensor = roleTerm(roleSwitch, !invertSensor);
+			*t++ = bothTerms(roleTerm(roleA, true), sensor);
+			*t++ = bothTerms(roleTerm(roleB, true), sensor);
+		} else {
+			*t++ = roleTerm(roleA, true);
+			*t++ = roleTerm(roleB, true);
+		}
+	} else {
+		MaskTerm position = alwaysTerm;
+		if (turnout > 0) {
+			position = roleTerm(roleTurnout, !invertTurnout);
+		}
+		if (useSwitch && switchOrSensor > 0) {
+			position = bothTerms(position, roleTerm(roleSwitch, !invertSensor));
+		}
+		*t++ = bothTerms(position, roleTerm(roleA, !invertA));
+		if (shortTrack > 0) {
+			*t++ = bothTerms(position, roleTerm(roleShort, !invertShortTrack));
+		}
+	}
+
+	if (sensorIn > 0) {
+		m.enterTrigger = roleTerm(roleIn, !invertInSensor);
+	} else if (switchOrSensor > 0 && !useSwitch) {
+		m.enterTrigger = roleTerm(roleSwitch, !invertSensor);
+	} else {
+		m.enterTrigger = alwaysTerm;
+	}
+
+	// selectedExitTrack(): the track role chosen in each turnout position
+	byte tnt = 0xff;
+	boolean inv = false;
+	if (turnout > 0) {
+		tnt = roleTurnout;
+		inv = invertTurnout;
+	}
+	if (useSwitch && (switchOrSensor > 0)) {
+		tnt = roleSwitch;
+		inv = invertSensor;
+	}
+	MaskTerm position[2];
+	byte track[2];
+	byte choices = 0;
+	if ((sensorA > 0) && (sensorB > 0) && (tnt != 0xff)) {
+		position[choices] = roleTerm(tnt, !inv);
+		track[choices++] = roleB;
+		position[choices] = roleTerm(tnt, inv);
+		track[choices++] = roleA;
+	} else if (sensorA > 0) {
+		position[choices] = (sensorB == 0 && tnt != 0xff) ? roleTerm(tnt, !inv) : alwaysTerm;
+		track[choices++] = roleA;
+	}
+
+	// occupied(), isValidExit()
+	t = m.terms + EndpointMasks::occupiedTerms;
+	MaskTerm* x = m.terms + EndpointMasks::validExitTerms;
+	for (byte c = 0; c < choices; c++) {
+		*t++ = bothTerms(position[c], roleTerm(track[c], true));
+		if (shortTrack > 0) {
+			*t++ = bothTerms(position[c], roleTerm(roleShort, true));
+		}
+		*x++ = bothTerms(position[c], roleTerm(shortTrack > 0 ? roleShort : track[c], false));
+	}
+
+	if (sensorOut > 0) {
+		m.exitTrigger = roleTerm(roleOut, !invertOutSensor);
+	} else if (!useSwitch && (switchOrSensor > 0)) {
+		m.exitTrigger = roleTerm(roleSwitch, !invertSensor);
+	} else if ((sensorA != 0) || (sensorB != 0)) {
+		m.exitTrigger = alwaysTerm;
+	} else {
+		m.exitTrigger = neverTerm;
+	}
+}
+
+boolean EndpointMasks::test(EndpointPredicate p, byte bits) const {
+	switch (p) {
+	case epValidEnter:
+		return any(validEnterTerms, occupiedTerms, bits);
+	case epPrimedEnter:
+		return enterTrigger.holds(bits) && any(validEnterTerms, occupiedTerms, bits);
+	case epOccupied:
+		return any(occupiedTerms, validExitTerms, bits);
+	case epValidExit:
+		return any(validExitTerms, termCount, bits);
+	case epPrimedExit:
+		return exitTrigger.holds(bits) && any(validExitTerms, termCount, bits);
+	}
+	return false;
+}
+
+/**
+ * Compiled masks of an endpoint of loopDefinitions, NULL for other endpoints (the edited loop).
+ */
+const EndpointMasks* compiledMasks(const Endpoint* ep) {
+	const byte* p = (const byte*)ep;
+	const byte* defs = (const byte*)loopDefinitions;
+	if (p < defs || p >= defs + sizeof(LoopDef) * maxLoopCount) {
+		return NULL;
+	}
+	int i = (p - defs) / sizeof(LoopDef);
+	const LoopDef& def = loopDefinitions[i];
+	if (!def.active) {
+		return NULL;
+	}
+	if (ep == &def.left) {
+		return &endpointMasks[i][0];
+	}
+	return ep == &def.right ? &endpointMasks[i][1] : NULL;
+}
+#endif
+
+boolean referenceTest(const Endpoint& ep, EndpointPredicate p) {
+	switch (p) {
+	case epValidEnter:	return ep.isValidEnter();
+	case epPrimedEnter:	return ep.isPrimedEnter();
+	case epValidExit:	return ep.isValidExit();
+	case epPrimedExit:	return ep.isPrimedExit();
+	case epOccupied:	return ep.occupied();
+	}
+	return false;
+}
+
+boolean Endpoint::test(EndpointPredicate p) const {
+#ifdef __loop_compiled_predicates
+	const EndpointMasks* masks = debugLoops ? NULL : compiledMasks(this);
+	if (masks != NULL) {
+		boolean v = masks->test(p, roleBits(sensorSnapshotTaken ? sensorSnapshot : s88EventSnapshot()));
+#ifdef __loop_check_predicates
+		if (v != referenceTest(*this, p)) {
+			Serial.print(F("Predicate mismatch: loop #"));
+			Serial.print(((const byte*)this - (const byte*)loopDefinitions) / sizeof(LoopDef) + 1);
+			Serial.print(F(", predicate ")); Serial.print(p);
+			Serial.print(F(", compiled ")); Serial.println(v);
+		}
+#endif
+		return v;
+	}
+#endif
+	return referenceTest(*this, p);
+}
+
 int Endpoint::occupiedTrackSensors() const {
 	int cnt = 0;
-	if (sensorA > 0 && readS88(sensorA)) {
+	if (sensorA > 0 && readSensor(sensorA)) {
 		cnt++;
 	}
-	if (sensorB > 0 && readS88(sensorB)) {
+	if (sensorB > 0 && readSensor(sensorB)) {
 		cnt++;
 	}
-	if (shortTrack > 0 && readS88(shortTrack)) {
+	if (shortTrack > 0 && readSensor(shortTrack)) {
 		cnt++;
 	}
 	return cnt;
@@ -672,6 +948,21 @@ boolean isRelayOn(int rid) {
 	return relayStates[rid - 1];
 }
 
+static_assert(maxRelayCount == 4, "writeRelayPin must handle every relay");
+
+/**
+ * Writes the relay output through the compile-time port mapping of the relay pins.
+ * The caller range-checks rid.
+ */
+void writeRelayPin(int rid, boolean level) {
+	switch (rid) {
+		case 1: FastPin<RELAY_1>::write(level); break;
+		case 2: FastPin<RELAY_2>::write(level); break;
+		case 3: FastPin<RELAY_3>::write(level); break;
+		case 4: FastPin<RELAY_4>::write(level); break;
+	}
+}
+
 void switchRelay(int rid, boolean on) {
 	if (rid <= 0 || rid > maxRelayCount) {
 		return;
@@ -679,7 +970,7 @@ void switchRelay(int rid, boolean on) {
 	if (logTransitions) {
 		Serial.print(F("Setting relay ")); Serial.print(rid); Serial.print(F(" => ")); Serial.println(on);
 	}
-	digitalWrite(relayPins[rid - 1], (on == relayOnHigh) ? HIGH : LOW);
+	writeRelayPin(rid, on == relayOnHigh);
 	relayStates[rid -1] = on;
 }
 
@@ -706,14 +997,14 @@ void LoopState::markDirSensor(boolean out) {
 		return;
 	}
 	if (x) {
-		leftSensorTime = millis();
+		leftSensorTime = loopMillis();
 		suspendS88(d.left.sensorIn);
 		suspendS88(d.left.sensorOut);
 		if (debugLoops) {
 			Serial.print(F("* Mark left sensor: ")); Serial.println(leftSensorTime);
 		}
 	} else {
-		rightSensorTime = millis();
+		rightSensorTime = loopMillis();
 		suspendS88(d.right.sensorIn);
 		suspendS88(d.right.sensorOut);
 		if (debugLoops) {
@@ -793,34 +1084,60 @@ void loopSensorCallback(int sensor, boolean state) {
 	}
 }
 
-void processSensorTriggers(int sensor, boolean state) {
-	for (int i = 0; i < maxLoopCount; i++) {
+/**
+ * Evaluates the loops for the changed sensors, in the loop order.
+ */
+void processLoops(loopmask_t loops, slotmask_t changed) {
+	takeSensorSnapshot();
+	while (loops) {
+		byte i = __builtin_ctz(loops);
+		loops &= loops - 1;
 		LoopState &st = loopStates[i];
-		LoopDef &def = loopDefinitions[i];
 
 		if (debugLoops) {
-			if (def.hasSensor(sensor)) {
-				Serial.print(F("Triggering loop #")); Serial.print(i + 1);
-				Serial.println(F(" Initial state"));
-				st.printState();
-			}
+			Serial.print(F("Triggering loop #")); Serial.print(i + 1);
+			Serial.println(F(" Initial state"));
+			st.printState();
 		}
-		st.processChange(sensor, state);
+		st.processChange(changed);
 		if (debugLoops) {
-			if (def.hasSensor(sensor)) {
-				Serial.println(F("Loop processed - new state:"));
-				st.printState();
-			}
+			Serial.println(F("Loop processed - new state:"));
+			st.printState();
 		}
 	}
+	releaseSensorSnapshot();
 }
 
+#ifdef __loop_coalesced_changes
+void processFrameTriggers(slotmask_t changed) {
+	// the loops which reference any of the sensors
+	loopmask_t loops = 0;
+	for (slotmask_t rest = changed; rest; rest &= rest - 1) {
+		loops |= sensorLoops[__builtin_ctzl(rest)];
+	}
+	processLoops(loops, changed);
+}
+#else
+void processSensorTriggers(const SensorEvent& event) {
+	int slot = findSensor(event.sensorId);
+	if (slot < 0) {
+		return;
+	}
+	// the millis of the frame which completed the change
+	sensorChangeMillis = millis() - (micros() - event.frameMicros) / 1000;
+	// only the loops which reference the sensor
+	processLoops(sensorLoops[slot], sensors.bit(slot));
+	sensorChangeMillis = 0;
+}
+#endif
+
 void resetLoops() {
 	Serial.println(F("Clearing all loops"));
 	for (int i = 0; i < maxLoopCount; i++) {
 		loopDefinitions[i] = LoopDef();
 		loopStates[i] = LoopState();
 	}
+	rebuildSensorLoops();
 	resetAllRelays();
 }
 
@@ -839,6 +1156,7 @@ boolean eepromLoadLoops() {
 		def.defineSensors();
 		loopStates[i] = LoopState();
 	}
+	rebuildSensorLoops();
 	resetAllRelays();
 	return true;
 }
@@ -853,6 +1171,7 @@ void relayStatus() {
 boolean periodicTriggers() {
 	// now process zero senors that have timed out:
 	long m = millis();
+	takeSensorSnapshot();
 	for (int i = 0; i < maxLoopCount; i++) {
 		LoopState &st = loopStates[i];
 		LoopDef &def = loopDefinitions[i];
@@ -907,20 +1226,24 @@ boolean periodicTriggers() {
 			st.handleOutage();
 		}
 	}
+	releaseSensorSnapshot();
 	return true;
 }
 
 void initLoopOutputs() {
-	pinMode(RELAY_1, OUTPUT);
-	pinMode(RELAY_2, OUTPUT);
-	pinMode(RELAY_3, OUTPUT);
-	pinMode(RELAY_4, OUTPUT);
+	for (int i = 0; i < maxRelayCount; i++) {
+		pinMode(relayPins[i], OUTPUT);
+	}
 }
 
 boolean loopsHandler(ModuleCmd cmd) {
 	switch (cmd) {
 	case initialize:
+#ifdef __loop_coalesced_changes
+		sensorFrameCallback = &processFrameTriggers;
+#else
 		sensorCallback = &processSensorTriggers;
+#endif
 		initLoopOutputs();
 		break;
 	case eepromLoad:
@@ -9,13 +9,107 @@
 #define LOOPS_H_
 
 #include <Arduino.h>
+#include "S88.h"
 
 const int maxLoopCount = 8;
 const int maxRelayCount = 4;
 
+/**
+ * Set of loops, one bit per loop; must be able to hold maxLoopCount bits.
+ */
+typedef byte loopmask_t;
+typedef char loopMaskFitsLoops[(maxLoopCount <= 8 * (int)sizeof(loopmask_t)) ? 1 : -1];
+
+/**
+ * If defined, the endpoint predicates are compiled into bit masks over the endpoint's sensors
+ * whenever the loops change, and Endpoint::test() evaluates them by a few AND / compare
+ * operations instead of walking the configuration. Costs 22 bytes of RAM per endpoint.
+ */
+#undef __loop_compiled_predicates
+
+/**
+ * If defined (requires __loop_compiled_predicates), each compiled evaluation is checked
+ * against the Endpoint methods and mismatches are printed.
+ */
+#undef __loop_check_predicates
+
+/**
+ * If defined, the loops get the sensor changes of an S88 frame at once: each loop referencing
+ * some of the sensors is evaluated once against the whole set, instead of once per sensor in
+ * the order of the events. A train crossing two sections in one frame then does not pass
+ * through the intermediate states, nor toggles the relays on the way.
+ */
+#undef __loop_coalesced_changes
+
+/**
+ * Endpoint predicates, see Endpoint::test().
+ */
+enum EndpointPredicate {
+	epValidEnter,
+	epPrimedEnter,
+	epValidExit,
+	epPrimedExit,
+	epOccupied
+};
+
+#ifdef __loop_compiled_predicates
+/**
+ * Bits of the endpoint's sensors in the compiled predicates; each bit is the raw state
+ * of the sensor in that role, 0 for an undefined one.
+ */
+enum EndpointRole {
+	roleA,
+	roleB,
+	roleTurnout,
+	roleIn,
+	roleOut,
+	roleShort,
+	roleSwitch
+};
+
+/**
+ * Conjunction over the role bits: holds if the bits selected by 'mask' equal 'value'.
+ * Inverted sensors just require 0 in 'value'.
+ */
+struct MaskTerm {
+	byte mask;
+	byte value;
+
+	boolean holds(byte bits) const {
+		return (bits & mask) == value;
+	}
+};
+
+/**
+ * Compiled predicates of an endpoint. isValidEnter(), occupied() and isValidExit() are
+ * disjunctions of terms; the selection made by the turnout is expanded into one term per
+ * turnout position. Unused terms never hold. The primed variants add a single trigger term.
+ */
+struct EndpointMasks {
+	static const byte validEnterTerms = 0;
+	static const byte occupiedTerms = 3;
+	static const byte validExitTerms = 7;
+	static const byte termCount = 9;
+
+	MaskTerm terms[termCount];
+	MaskTerm enterTrigger;
+	MaskTerm exitTrigger;
+
+	boolean any(byte from, byte to, byte bits) const {
+		for (byte i = from; i < to; i++) {
+			if (terms[i].holds(bits)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	boolean test(EndpointPredicate p, byte bits) const;
+};
+#endif
+
 typedef int (*sensorIteratorFunc)(int sensorId, boolean triggerType);
 extern int freeUnusedSensors();
-extern int relayPins[maxRelayCount];
 
 struct LoopState;
 struct LoopDef;
@@ -116,7 +210,11 @@ struct Endpoint {
 	 */
 	boolean isPrimedEnter() const;
 
-	boolean changedOccupied(int sensor, boolean occupied) const;
+	/**
+	 * The selected track, or the turnout / switch deselecting it, is among the changed
+	 * sensors, and the track's occupation is now 'occupied'.
+	 */
+	boolean changedOccupied(slotmask_t changed, boolean occupied) const;
 
 	/**
 	 * Some part of track is occupied.
@@ -153,12 +251,37 @@ struct Endpoint {
 			   (turnout == id) || (sensorIn == id) || (sensorOut == id) || (shortTrack == id);
 	}
 
+	/**
+	 * One of the endpoint's sensors is in the set of changed sensors, one bit per slot.
+	 */
+	boolean hasSensorIn(slotmask_t changed) const;
+
+	boolean hasTriggerIn(slotmask_t changed) const {
+		return sensorInSet(changed, sensorIn) || sensorInSet(changed, sensorOut);
+	}
+
 	void printState() const;
 
 	int forSensors(sensorIteratorFunc fn) const;
 
 	int occupiedTrackSensors() const;
 
+	/**
+	 * Evaluates the predicate. With __loop_compiled_predicates, an endpoint of a defined loop uses its
+	 * compiled masks; the methods above remain the reference implementation, and produce
+	 * the diagnostics if debugLoops is on.
+	 */
+	boolean test(EndpointPredicate p) const;
+
+#ifdef __loop_compiled_predicates
+	void compile(EndpointMasks& masks) const;
+
+	/**
+	 * States of the endpoint's sensors in the snapshot, one bit per EndpointRole.
+	 */
+	byte roleBits(slotmask_t snapshot) const;
+#endif
+
 	void dump(boolean left) const;
 
 	void monitorPrint() const;
@@ -187,6 +310,9 @@ struct LoopCore {
 	boolean hasSensor(int id) const {
 		return (trackA == id) || (trackB == id);
 	}
+	boolean hasSensorIn(slotmask_t changed) const {
+		return sensorInSet(changed, trackA) || sensorInSet(changed, trackB);
+	}
 	boolean occupied() const;
 	void printState() const;
 	void monitorPrint() const;
@@ -354,26 +480,15 @@ struct LoopState {
 	long dirSensorTime(boolean moveOut) const { return moveOut == (direction == left) ? leftSensorTime : rightSensorTime; }
 	void markDirSensor(boolean out);
 	void switchStatus(Status s, const Endpoint& e);
-	void processChange(int sensor, boolean state);
+	/**
+	 * Evaluates the state machine for the changed sensors, one bit per slot.
+	 */
+	void processChange(slotmask_t changed);
 	void printState() const;
 	void monitorPrint() const;
 
 	void switchRelayTo(const Endpoint& toEndpoint);
 
-	void processIdle(int sensor);
-	void processOccupied(int sensor, boolean s);
-	void processApproach(int sensor, const Endpoint& ep);
-	void processReadyEnter(int sensor, const Endpoint& ep);
-	void processEntering(int sensor, const Endpoint& from);
-	void processMoving(int sensor, const Endpoint& from);
-	void processArmed(int sensor, const Endpoint& to);
-	void processExiting(int sensor, const Endpoint& to);
-	void processExited(int sensor, const Endpoint& to);
-
-	boolean maybeCoreAbandoned(int sensor);
-	void maybeReadyEnter(const Endpoint& via);
-	void maybeArm(const Endpoint& via);
-	void maybeApproach(Status prevStatus, const Endpoint& from);
 	void maybeFreeRelay(const Endpoint& via);
 
 	void handleOutage();
@@ -382,6 +497,34 @@ struct LoopState {
 
 boolean defineLoop(int id, const LoopDef& def);
 
+/**
+ * Loop predicates read sensors by readSensor(). Between takeSensorSnapshot() and
+ * releaseSensorSnapshot() it tests a snapshot of all sensors taken once, so the whole
+ * processing pass sees the same bus state; outside it reads the sensor directly.
+ * For a delivered sensor event the snapshot is the bus state as of that event, see
+ * s88EventSnapshot().
+ */
+void takeSensorSnapshot();
+void releaseSensorSnapshot();
+boolean readSensor(int sensor);
+
+/**
+ * Millis to record for the sensor change being processed: the time of its frame, not
+ * the time the loops got to it; millis() outside a change.
+ */
+long loopMillis();
+
+/**
+ * Recomputes the loops referencing each sensor; must be called after the loop definitions
+ * or the sensor table slots change.
+ */
+void rebuildSensorLoops();
+
+/**
+ * Prints the state machine transition tables, one row per line.
+ */
+void dumpTransitions();
+
 String statName(Status s);
 String statName(Status s, Direction d);
 void switchRelay(int rid, boolean on);
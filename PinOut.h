@@ -9,11 +9,40 @@
 #define PINOUT_H_
 
 
+/**
+ * If defined, the S88 bus is captured by the SPI peripheral in slave mode, with one
+ * interrupt per byte instead of one per CLOCK edge. Requires __s88_deferred and a
+ * different wiring: CLOCK to SCK (13), DATA to MOSI (11); SS (10) must be tied to GND.
+ * The relays and LEDs move off the SPI pins. The bus must have a multiple of 8 bits.
+ *
+ * The SPI slave can only send out a byte it received before, which would shift all the
+ * modules after it by 8 bits. So there is no pass-through: the controller must be the
+ * last device before the command station and only listens, with DATA wired to both the
+ * MOSI and the command station's input. DATA_OUT is not defined, MISO stays an input.
+ */
+#undef __s88_spi
+
+/**
+ * If defined, a second S88 chain is read on DATA_IN_2. It shares LOAD and CLOCK with
+ * the main bus, so it must not be longer than the main bus; its bits are not passed to
+ * the command station. Not available with __s88_spi.
+ */
+#undef __s88_second_bus
+
 // ------- S88 interface -----------
 const int LOAD_INT_0      = 2 ;        // 2 LOAD 0 int
+#ifdef __s88_spi
+const int CLOCK_SCK       = 13 ;       // CLOCK to SPI SCK
+const int DATA_IN         = 11 ;       // data in, SPI MOSI
+const int SPI_SS          = 10 ;       // SPI SS, tied to GND
+#else
 const int CLOCK_INT_1     = 3 ;        // 3 CLOCK 1 int
 const int DATA_IN         = 4 ;        // data in
 const int DATA_OUT        = 5 ;        // data out
+#endif
+#ifdef __s88_second_bus
+const int DATA_IN_2       = 15 ;       // data in of the second bus, A1
+#endif
 
 /**
  * Button "plus" from the control panel; input
@@ -30,6 +59,15 @@ const int BUTTON_MINUS    = 7;
  */
 const int BUTTON_NEXT     = 8;
 
+#ifdef __s88_spi
+const int LED_SIGNAL      = 14;       // signal LED, A0
+const int LED_ACK         = 14;       // ACK LED, A0
+
+const int RELAY_1		  = 4;
+const int RELAY_2		  = 5;
+const int RELAY_3		  = 9;
+const int RELAY_4		  = 3;
+#else
 /**
  * Indicator LED from the control panel; output
  */
@@ -47,6 +85,7 @@ const int RELAY_1		  = 12;
 const int RELAY_2		  = 11;
 const int RELAY_3		  = 9;
 const int RELAY_4		  = 10;
+#endif
 
 // 2345   9 10 11 12  	6 7 8 A0  vstupy: A1 A2 A3 A4
 
@@ -11,6 +11,10 @@
 #include "Common.h"
 #include "Utils.h"
 #include "Terminal.h"
+#include "FastIO.h"
+#include "S88Stats.h"
+#include "Trace.h"
+#include "S88Output.h"
 
 byte s88Sensorstates[s88MaxSize_bytes] = { 0 };
 boolean s88BusChanged = false;
@@ -18,113 +22,309 @@ boolean s88BusChanged = false;
 // Shamelessly copied from https://sites.google.com/site/sidloweb/elektrika/s88-ir-detektor
 // Copyright (c) Sidlo
 byte data = 0 ;                   	// data byte
+#ifdef __s88_second_bus
+byte data2 = 0;						// data byte of the second bus
+#endif
 int bitCounter = 0 ;              	// bit counter
 short byteIndex = 0;
 
+/**
+ * Bus length detection: clocks counted in the last LOAD cycle and the number of following
+ * cycles with the same count. The length is accepted once the count repeats s88LengthConfirm times.
+ */
+int s88LastClocks = -1;
+byte s88SameClocks = 0;
+const byte s88LengthConfirm = 3;
+
+/**
+ * Detected number of clocks per LOAD, 0 until known.
+ */
+volatile int s88DetectedClocks = 0;
+
+/**
+ * Frame bytes of each bus covered by the detected length; s88BusMaxSize until known.
+ */
+volatile byte s88DetectedBytes = s88BusMaxSize;
+
+#ifdef __s88_deferred
+/**
+ * Frame double buffer. The CLOCK interrupt shifts into s88FrameBuffers[s88ShiftFrame],
+ * the other buffer holds the last complete frame. LOAD swaps the buffers, unless
+ * the main loop currently holds the complete frame.
+ */
+byte s88FrameBuffers[2][s88MaxSize_bytes];
+unsigned long s88FrameLoadMicros[2];
+volatile byte s88ShiftFrame = 0;
+
+/**
+ * Set by LOAD when the complete buffer holds a frame not yet acquired by the main loop.
+ */
+volatile boolean s88FrameReady = false;
+
+/**
+ * Set by the main loop while it reads the complete buffer; LOAD will not swap
+ * and drops the frame instead.
+ */
+volatile boolean s88FrameHeld = false;
+
+/**
+ * Frames dropped because the main loop held the previous one.
+ */
+volatile unsigned int s88FramesDropped = 0;
+
+/**
+ * Frames passed to the main loop, and frames rejected by the integrity check because
+ * of a clock count different from the bus length, or a wrong sentinel.
+ */
+volatile unsigned long s88FramesAccepted = 0;
+volatile unsigned int s88BadLengthFrames = 0;
+volatile unsigned int s88BadSentinelFrames = 0;
+
+#endif
+
+#ifdef __s88_vertical_debounce
+/**
+ * True, if some bus bits are still debouncing and the next frame must be processed
+ * even if it is the same as the previous one.
+ */
+boolean s88DebouncePending = false;
+
+/**
+ * Set when the sensor timings change and the debounce thresholds must be recomputed.
+ */
+boolean s88ThresholdsDirty = true;
+
+/**
+ * Bus period the thresholds were computed for.
+ */
+long s88ThresholdQuantum = 0;
+#endif
+
 /**
  * Sensor table. The table is accessed in an interrupt, so no moves are permitted to
  * avoid sync issues.
  */
-Sensor sensors[maxSensorCount];
+SensorTable<maxSensorCount> sensors;
 
 /**
- * Millis counter at the last LOAD interrupt.
+ * Maps sensor ID to its slot in the sensor table, offset by 1; 0 means the ID
+ * is not defined. Maintained by defineSensor() and freeSensor(), read also
+ * from the interrupt, so the slot must be fully set up before the index points to it.
  */
-long lastS88Millis = 0;
+byte sensorSlots[maxSensorId + 1] = { 0 };
+
+/**
+ * Micros of the last LOAD, the time base of all the sensor timestamps.
+ */
+unsigned long lastS88Micros = 0;
+
+/**
+ * Micros of the frame processed last by the debounce.
+ */
+unsigned long s88ProcessedMicros = 0;
 
 /**
  * The actual sensor count, must be <= maxSensorCount.
  */
 int sensorCount = 0;
 
-sensorChangeFunc sensorCallback = NULL;
+/**
+ * Sensors with a change not yet delivered to sensorCallback, one bit per slot. Written
+ * by the main loop only.
+ */
+slotmask_t s88PendingSlots = 0;
 
-Sensor::Sensor(const SensorData& d) :
-	reportState(false), s88State(false), triggerChange(false), changing(false), changeProcessing(false), overriden(false) {
-	sensorId = d.sensorId;
-	sensorDownDebounce = d.sensorDownDebounce;
-	sensorUpDebounce = d.sensorUpDebounce;
-	triggerSensor = d.triggerSensor;
-}
+#ifndef __s88_deferred
+/**
+ * Changes found by the debounce in the CLOCK interrupt. Only the interrupt sets bits;
+ * the main loop takes the whole set by takeIsrPending().
+ */
+volatile slotmask_t s88IsrPendingSlots = 0;
+#endif
 
-SensorData::SensorData(const Sensor& s) {
-	sensorId = s.sensorId;
-	sensorDownDebounce = s.sensorDownDebounce;
-	sensorUpDebounce = s.sensorUpDebounce;
-	triggerSensor = s.triggerSensor;
-}
+/**
+ * Sensors whose change is being delivered by s88InLoop().
+ */
+slotmask_t s88ProcessingSlots = 0;
 
-int Sensor::upDebounceTime() const {
-	if (sensorUpDebounce == 0) {
-		return triggerSensor ? defaultTiming.triggerUpDebounce : defaultTiming.trackUpDebounce;
-	} else {
-		return sensorUpDebounce;
+/**
+ * Sensor states as of the event being delivered by s88InLoop(), see s88EventSnapshot().
+ */
+slotmask_t s88EventState = 0;
+boolean s88Delivering = false;
+
+/**
+ * Sensors in the middle of the debounce, or just defined; processed by the next frame.
+ */
+slotmask_t s88ChangingSlots = 0;
+
+/**
+ * Sensor change events, in the order of the debounce. The debounce (the interrupt in the
+ * per-bit mode) appends at s88EventHead, s88InLoop() consumes from s88EventTail.
+ */
+SensorEvent s88Events[s88EventQueueSize];
+volatile byte s88EventHead = 0;
+volatile byte s88EventTail = 0;
+
+/**
+ * Sensors whose event did not fit in the full queue. Their change is still delivered,
+ * with the then current state, after the queued events.
+ */
+volatile slotmask_t s88OverflowSlots = 0;
+
+/**
+ * Queue statistics: events queued, events that did not fit, max queue depth.
+ */
+volatile unsigned long s88EventCount = 0;
+volatile unsigned int s88EventsLost = 0;
+volatile byte s88EventMaxDepth = 0;
+
+/**
+ * Appends the event for the current reported state of the slot.
+ */
+inline void pushEvent(byte slot, unsigned long when) {
+	byte head = s88EventHead;
+	byte next = (head + 1) & (s88EventQueueSize - 1);
+	if (next == s88EventTail) {
+		s88EventsLost++;
+		s88OverflowSlots |= sensors.bit(slot);
+		return;
+	}
+	SensorEvent& e = s88Events[head];
+	e.sensorId = sensors.sensorId[slot];
+	e.state = sensors.test(sensors.reportState, slot);
+	e.frameMicros = when;
+	s88EventHead = next;
+	s88EventCount++;
+	byte depth = (next - s88EventTail) & (s88EventQueueSize - 1);
+	if (depth > s88EventMaxDepth) {
+		s88EventMaxDepth = depth;
 	}
 }
 
-int Sensor::downDebounceTime() const {
-	if (sensorDownDebounce == 0) {
-		return triggerSensor ? defaultTiming.triggerDownDebounce : defaultTiming.trackDownDebounce;
-	} else {
-		return sensorUpDebounce;
-	}
+/**
+ * Records a debounced change of the sensor in the slot, found in the frame 'when'.
+ * Called by the debounce, so in the per-bit mode it runs in the interrupt and must not
+ * touch the main loop's set.
+ */
+inline void debouncedChange(byte slot, unsigned long when) {
+	pushEvent(slot, when);
+#ifdef __s88_sensor_stats
+	sensorStatsChange(slot, sensors.test(sensors.reportState, slot), when);
+#endif
+#ifdef __s88_deferred
+	s88PendingSlots |= sensors.bit(slot);
+#else
+	s88IsrPendingSlots |= sensors.bit(slot);
+#endif
 }
 
-void Sensor::dumpTimeouts() const {
-	if ((sensorUpDebounce == 0) && (sensorDownDebounce == 0)) {
+inline byte lowestSlot(slotmask_t mask) {
+	return __builtin_ctzl(mask);
+}
+
+sensorChangeFunc sensorCallback = NULL;
+sensorFrameFunc sensorFrameCallback = NULL;
+
+template<int N> void SensorTable<N>::dumpTimeouts(byte slot) const {
+	boolean filter = false;
+#ifdef __s88_frame_filter
+	filter = frameFilter[slot] != 0;
+#endif
+	if ((upDebounce[slot] == 0) && (downDebounce[slot] == 0) && !filter) {
 		return;
 	}
-	Serial.print(F("STM:")); Serial.print(sensorId);
-	if (sensorDownDebounce > 0) {
-		Serial.print(F(":D=")); Serial.print(sensorDownDebounce);
+	Serial.print(F("STM:")); Serial.print(sensorId[slot]);
+	if (downDebounce[slot] > 0) {
+		Serial.print(F(":D=")); Serial.print(downDebounce[slot]);
+	}
+	if (upDebounce[slot] > 0) {
+		Serial.print(F(":U=")); Serial.print(upDebounce[slot]);
+	}
+#ifdef __s88_frame_filter
+	if (filter) {
+		Serial.print(F(":K=")); Serial.print(filterVotes(slot));
+		Serial.print(F(":N=")); Serial.print(filterWindow(slot));
 	}
-	if (sensorDownDebounce > 0) {
-		Serial.print(F(":U=")); Serial.print(sensorUpDebounce);
+#endif
+}
+
+template<int N> void SensorTable<N>::print(byte slot) const {
+	Serial.print(F("Sensor #"));
+	Serial.print(slot);
+	Serial.print("("); Serial.print(sensorId[slot]);
+	Serial.print(F("): state(")); Serial.print(test(reportState, slot));
+	Serial.print(F("), s88(")); Serial.print(test(s88State, slot)); Serial.print(")");
+	if (test(changing, slot)) {
+		Serial.print(F(" - millis: ")); Serial.print((micros() - stableFrom[slot]) / 1000);
 	}
+	Serial.println();
 }
 
-void Sensor::printAll(boolean includeNone) {
+template struct SensorTable<maxSensorCount>;
+
+void printSensors(boolean includeNone) {
 	for (int i = 0; i < maxSensorCount; i++) {
-		const Sensor& s = sensors[i];
-		if (includeNone || s.isDefined()) {
-			s.print();
+		if (includeNone || sensors.isDefined(i)) {
+			sensors.print(i);
 		}
 	}
 }
 
-void Sensor::print() const {
-	Serial.print(F("Sensor #"));
-	Serial.print((this - sensors));
-	Serial.print("("); Serial.print(sensorId);
-	Serial.print(F("): state(")); Serial.print(reportState);
-	Serial.print(F("), s88(")); Serial.print(s88State); Serial.print(")");
-	if (changing) {
-		long ms = millis() & 0xffff;
-		if (ms < stableFrom) {
-			ms += 0x1000;
+int findSensor(int id) {
+	if (id <= 0 || id > maxSensorId) {
+		return -1;
+	}
+	return (int)sensorSlots[id] - 1;
+}
+
+void rebuildSensorSlots() {
+	memset(sensorSlots, 0, sizeof(sensorSlots));
+	sensors.defined = 0;
+	for (int i = 0; i < maxSensorCount; i++) {
+		if (sensors.isDefined(i)) {
+			sensorSlots[sensors.sensorId[i]] = i + 1;
+			sensors.defined |= sensors.bit(i);
 		}
-		Serial.print(F(" - millis: ")); Serial.print(ms - stableFrom);
 	}
-	Serial.println();
 }
 
 boolean defineSensor(int id, boolean trigger) {
-	if (sensorCount >= maxSensorCount) {
+	if (id <= 0 || id > maxSensorId) {
 		return false;
 	}
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == id) {
-			s.triggerSensor = trigger;
-			return true;
-		} else if (s.sensorId <= 0) {
-			s = Sensor(id);
-			s.triggerSensor = trigger;
-			sensorCount++;
-			return true;
+	int existing = findSensor(id);
+	if (existing >= 0) {
+		if (sensors.test(sensors.triggerSensor, existing) != trigger) {
+			sensors.assign(sensors.triggerSensor, existing, trigger);
+			s88TimingChanged();
 		}
+		return true;
+	}
+	if (sensorCount >= maxSensorCount) {
+		return false;
+	}
+	// the lowest free slot
+	slotmask_t free = ~sensors.defined;
+	if (free == 0) {
+		return false;
 	}
-	return false;
+	byte i = lowestSlot(free);
+	if (i >= maxSensorCount) {
+		return false;
+	}
+	noInterrupts();
+	sensors.init(i, id, trigger);
+	sensorSlots[id] = i + 1;
+#ifdef __s88_sensor_stats
+	sensorStatsClear(i);
+#endif
+	interrupts();
+	sensorCount++;
+	// pick up the current bus state
+	s88ChangingSlots |= sensors.bit(i);
+	s88TimingChanged();
+	return true;
 }
 
 boolean defineSensor(int id) {
@@ -134,86 +334,338 @@ boolean defineSensor(int id) {
 int forSensors(sensorIteratorFunc fn) {
 	int cnt = 0;
 	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId > 0) {
-			cnt += fn(s.sensorId, s.triggerSensor);
+		if (sensors.isDefined(i)) {
+			cnt += fn(sensors.sensorId[i], sensors.test(sensors.triggerSensor, i));
 		}
 	}
 	return cnt;
 }
 
 boolean freeSensor(int id) {
-	if (sensorCount == 0) {
+	int slot = findSensor(id);
+	if (slot < 0) {
 		return false;
 	}
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == id) {
-			s.clear();
-			sensorCount--;
-			return true;
-		}
-	}
-	return false;
+	slotmask_t mask = ~sensors.bit(slot);
+	// the interrupt updates the flag words of the other sensors meanwhile
+	noInterrupts();
+	sensorSlots[id] = 0;
+#ifndef __s88_deferred
+	s88IsrPendingSlots &= mask;
+#endif
+	s88OverflowSlots &= mask;
+	sensors.clear(slot);
+	interrupts();
+	s88PendingSlots &= mask;
+	s88ChangingSlots &= mask;
+	sensorCount--;
+	s88TimingChanged();
+	return true;
 }
 
 boolean s88Changed(int sensor) {
-	for (int i = 0; i < sensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == sensor) {
-			return s.triggerChange || s.changeProcessing;
+	int slot = findSensor(sensor);
+	if (slot < 0) {
+		return false;
+	}
+	slotmask_t changed = s88PendingSlots | s88ProcessingSlots;
+#ifndef __s88_deferred
+	noInterrupts();
+	changed |= s88IsrPendingSlots;
+	interrupts();
+#endif
+	return (changed & sensors.bit(slot)) != 0;
+}
+
+void s88ProcessFrame();
+
+void deliverEvent(byte i, const SensorEvent& e) {
+	if (debugS88) {
+		Serial.print(F("Sensor ")); Serial.print(e.sensorId); Serial.print(" trigger:"); Serial.print(sensors.test(sensors.triggerSensor, i));
+		Serial.print(F(" changed to: ")); Serial.print(e.state);
+		Serial.print(F(" Reported after "));
+		Serial.println((e.frameMicros - sensors.stableFrom[i]) / 1000);
+	}
+	if (sensorCallback) {
+		sensorCallback(e);
+	}
+}
+
+/**
+ * Collects the delivered changes of one frame for sensorFrameCallback.
+ */
+slotmask_t s88FrameChanges = 0;
+unsigned long s88FrameChangesMicros;
+
+void deliverFrame() {
+	if (s88FrameChanges == 0) {
+		return;
+	}
+	slotmask_t changed = s88FrameChanges;
+	s88FrameChanges = 0;
+	if (sensorFrameCallback) {
+		sensorFrameCallback(changed);
+	}
+}
+
+/**
+ * Makes s88FrameChanges collect the changes of the frame; the changes collected from
+ * another frame are delivered first.
+ */
+void collectFrameChanges(unsigned long frameMicros) {
+	if (s88FrameChanges != 0 && s88FrameChangesMicros != frameMicros) {
+		deliverFrame();
+	}
+	s88FrameChangesMicros = frameMicros;
+}
+
+/**
+ * Applies the queued events of the frame starting at 'from' to s88EventState, as the
+ * sensors of one frame change at once. Returns the index past the frame's events.
+ */
+byte applyFrameEvents(byte from, byte end) {
+	unsigned long frame = s88Events[from].frameMicros;
+	byte t = from;
+	for (; t != end && s88Events[t].frameMicros == frame; t = (t + 1) & (s88EventQueueSize - 1)) {
+		int i = findSensor(s88Events[t].sensorId);
+		if (i >= 0 && !sensors.test(sensors.suspended, i)) {
+			sensors.assign(s88EventState, i, s88Events[t].state);
 		}
 	}
-	return false;
+	return t;
 }
 
 void s88InLoop() {
-	for (int i = 0; i < sensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.triggerChange) {
-			s.changeProcessing = true;
-			s.triggerChange = false;
+#ifdef __s88_deferred
+	s88ProcessFrame();
+#endif
+	// take the changes and the events recorded so far at once; the interrupt may add more meanwhile
+	noInterrupts();
+	slotmask_t pending = s88PendingSlots;
+#ifndef __s88_deferred
+	pending |= s88IsrPendingSlots;
+	s88IsrPendingSlots = 0;
+#endif
+	slotmask_t lost = s88OverflowSlots;
+	s88OverflowSlots = 0;
+	byte end = s88EventHead;
+	interrupts();
+	if (pending == 0) {
+		return;
+	}
+	s88PendingSlots = 0;
+	// retain "changed" for this process cycle.
+	s88ProcessingSlots = pending;
+	slotmask_t deferred = 0;
+	slotmask_t delivered = 0;
+
+	// the states before the queued events: a queued sensor had the opposite of its first event
+	s88EventState = s88Snapshot();
+	slotmask_t seen = 0;
+	for (byte t = s88EventTail; t != end; t = (t + 1) & (s88EventQueueSize - 1)) {
+		int i = findSensor(s88Events[t].sensorId);
+		if (i < 0) {
+			continue;
+		}
+		slotmask_t mask = sensors.bit(i);
+		if ((seen | sensors.suspended) & mask) {
+			continue;
 		}
+		seen |= mask;
+		sensors.assign(s88EventState, i, !s88Events[t].state);
 	}
-	unsigned long processed = 0x00;
-	unsigned long mask = 0x01;
-
-	for (int i = 0; i < sensorCount; i++, mask = mask << 1) {
-		Sensor& s = sensors[i];
-		if (s.changeProcessing) {
-			s.triggerChange = false;
-			if (s.suspended) {
-				continue;
-			}
-			// retain "changing" for this process cycle.
-			processed |= mask;
-			if (debugS88) {
-				Serial.print(F("Sensor ")); Serial.print(s.sensorId); Serial.print(" trigger:"); Serial.print(s.triggerSensor);
-				Serial.print(F(" changed to: ")); Serial.print(s.reportState);
-				Serial.print(F(" Reported after "));
-				unsigned long l = lastS88Millis & 0xffff;
-				if (l < s.stableFrom) {
-					l += 0x10000;
-				}
-				Serial.println(l - s.stableFrom);
-			}
-			if (sensorCallback) {
-				sensorCallback(s.sensorId, s.s88State);
-			}
+	s88Delivering = true;
+
+	byte tail = s88EventTail;
+	byte frameEnd = tail;
+	while (tail != end) {
+		if (tail == frameEnd) {
+			// the previous frame's changes go out before the next frame is applied
+			collectFrameChanges(s88Events[tail].frameMicros);
+			frameEnd = applyFrameEvents(tail, end);
 		}
+		SensorEvent e = s88Events[tail];
+		tail = (tail + 1) & (s88EventQueueSize - 1);
+		s88EventTail = tail;
+		int i = findSensor(e.sensorId);
+		if (i < 0) {
+			continue;
+		}
+		collectFrameChanges(e.frameMicros);
+		slotmask_t mask = sensors.bit(i);
+		// callbacks may suspend sensors, so test each one just before delivery
+		if (sensors.suspended & mask) {
+			deferred |= mask;
+			continue;
+		}
+		delivered |= mask;
+		s88FrameChanges |= mask;
+		deliverEvent(i, e);
 	}
-	mask = 0x01;
-	for (int i = 0; i < sensorCount; i++, mask = mask << 1) {
-		if ((processed & mask) > 0) {
-			Sensor& s = sensors[i];
-			s.changeProcessing = false;
+
+	// changes without a queued event: the queue was full, or the sensor was resumed
+	slotmask_t rest = ((pending & ~delivered) | lost) & ~deferred;
+	while (rest) {
+		byte i = lowestSlot(rest);
+		slotmask_t mask = sensors.bit(i);
+		rest &= ~mask;
+		collectFrameChanges(s88FrameMicros());
+		if (sensors.suspended & mask) {
+			deferred |= mask;
+			continue;
 		}
+		SensorEvent e;
+		e.sensorId = sensors.sensorId[i];
+		e.state = sensors.test(sensors.reportState, i);
+		e.frameMicros = s88FrameMicros();
+		s88FrameChanges |= mask;
+		sensors.assign(s88EventState, i, e.state);
+		deliverEvent(i, e);
 	}
+	deliverFrame();
+	s88Delivering = false;
+	s88ProcessingSlots = 0;
+	// suspended sensors keep their change until resumed
+	s88PendingSlots |= deferred;
+}
+
+void s88EventStatus() {
+	noInterrupts();
+	unsigned long count = s88EventCount;
+	unsigned int lost = s88EventsLost;
+	byte depth = (s88EventHead - s88EventTail) & (s88EventQueueSize - 1);
+	interrupts();
+	Serial.print(F("S88 events: ")); Serial.print(count);
+	Serial.print(F(", queued: ")); Serial.print(depth);
+	Serial.print(F(", max depth: ")); Serial.print(s88EventMaxDepth);
+	Serial.print(F(", overflows: ")); Serial.println(lost);
 }
 
 // ==================== Routines run in the interrupt ======================
 long millisQuantum = 50;
 
+#ifdef __s88_frame_filter
+boolean setFrameFilter(byte slot, byte votes, byte window) {
+	if (votes > 0 && (window > s88FilterMaxFrames || votes > window || 2 * votes <= window)) {
+		return false;
+	}
+	noInterrupts();
+	sensors.frameFilter[slot] = votes > 0 ? (votes << 4) | window : 0;
+	// fill the window with the reported state; the next frames vote from there
+	sensors.frameHistory[slot] = sensors.test(sensors.reportState, slot) ? 0xff : 0;
+	sensors.changing |= sensors.bit(slot);
+	interrupts();
+	s88ChangingSlots |= sensors.bit(slot);
+	return true;
+}
+
+/**
+ * Debounces the sensor by its frame filter: shifts the bus state into the frame history and
+ * reports a change once the votes for the other state reach the threshold. The sensor stays
+ * 'changing', so it is processed every frame, until the whole window agrees with the
+ * reported state; skipped frames then would just shift in the same state.
+ */
+void filterSensor(byte i, boolean state, boolean skipOverride, unsigned long now) {
+	slotmask_t mask = sensors.bit(i);
+	byte h = (sensors.frameHistory[i] << 1) | (state ? 1 : 0);
+	sensors.frameHistory[i] = h;
+	if (state != ((sensors.s88State & mask) != 0)) {
+#ifdef __s88_sensor_stats
+		sensorStatsEdge(i, state, (sensors.reportState & mask) != 0, now);
+#endif
+		sensors.stableFrom[i] = now;
+	}
+	sensors.assign(sensors.s88State, i, state);
+	if ((sensors.overriden & mask) && skipOverride) {
+		return;
+	}
+	byte window = (1 << sensors.filterWindow(i)) - 1;
+	boolean reportState = (sensors.reportState & mask) != 0;
+	byte against = (reportState ? ~h : h) & window;
+	if (__builtin_popcount(against) >= sensors.filterVotes(i)) {
+		reportState = !reportState;
+		if (traceMask & traceDebounce) {
+			trace(traceTrigger, sensors.sensorId[i], reportState, (now - sensors.stableFrom[i]) / 1000);
+		}
+		sensors.assign(sensors.reportState, i, reportState);
+		debouncedChange(i, now);
+		against = (reportState ? ~h : h) & window;
+	}
+	sensors.assign(sensors.changing, i, against != 0);
+}
+#endif
+
+/**
+ * Runs the debounce for a single sensor, given its current bus state.
+ */
+void debounceSensor(byte i, int state, boolean skipOverride, unsigned long now) {
+#ifdef __s88_frame_filter
+	if (sensors.frameFilter[i]) {
+		filterSensor(i, state, skipOverride, now);
+		return;
+	}
+#endif
+	int sensorId = sensors.sensorId[i];
+	slotmask_t mask = sensors.bit(i);
+	boolean s88State = (sensors.s88State & mask) != 0;
+#ifdef __s88_sensor_stats
+	if (state != s88State) {
+		sensorStatsEdge(i, state, (sensors.reportState & mask) != 0, now);
+	}
+#endif
+	if ((sensors.overriden & mask) && skipOverride) {
+		if (state != s88State) {
+			sensors.stableFrom[i] = now;
+		}
+		sensors.assign(sensors.s88State, i, state);
+		return;
+	}
+	boolean changing = (sensors.changing & mask) != 0;
+	boolean reportState = (sensors.reportState & mask) != 0;
+	// elapsed millis; the unsigned difference is correct across the micros() wrap
+	unsigned long l = changing ? (now - sensors.stableFrom[i]) / 1000 : 0;
+	if (state == reportState) {
+		if ((traceMask & traceDebounce) && changing) {
+			trace(traceReset, sensorId, state, l);
+		}
+		sensors.assign(sensors.s88State, i, state);
+		sensors.changing &= ~mask;
+		return;
+	}
+	unsigned int deb = state ? sensors.upDebounceTime(i) : sensors.downDebounceTime(i);
+	if (state == s88State) {
+		if (!changing) {
+			return;
+		}
+		if (l >= deb) {
+			if (traceMask & traceDebounce) {
+				trace(traceTrigger, sensorId, state, l);
+			}
+			sensors.changing &= ~mask;
+			sensors.assign(sensors.reportState, i, state);
+			debouncedChange(i, now);
+		} else if (traceMask & traceDebounce) {
+			trace(traceSteady, sensorId, state, l);
+		}
+	} else if (millisQuantum > deb) {
+		if (traceMask & traceDebounce) {
+			trace(traceTrigger, sensorId, state, 0);
+		}
+		sensors.assign(sensors.s88State, i, state);
+		sensors.changing &= ~mask;
+		sensors.assign(sensors.reportState, i, state);
+		sensors.stableFrom[i] = now;
+		debouncedChange(i, now);
+	} else {
+		sensors.assign(sensors.s88State, i, state);
+		sensors.changing |= mask;
+		sensors.stableFrom[i] = now;
+		if (traceMask & traceDebounce) {
+			trace(traceChanging, sensorId, state, now / 1000);
+		}
+	}
+}
+
 void storeS88Bit(int sensorId, int state, boolean skipOverride) {
 	byte stateIdx = (sensorId - 1) / 8;
 	byte stateMask = 1 << ((sensorId -1) % 8);
@@ -221,100 +673,365 @@ void storeS88Bit(int sensorId, int state, boolean skipOverride) {
 	boolean cur = (s88Sensorstates[stateIdx] & stateMask) > 0;
 	if (cur != state) {
 		s88BusChanged = true;
+#ifdef __s88_calibration
+		if (s88Calibrating) {
+			calibrationEdge(sensorId, state, lastS88Micros);
+		}
+#endif
 	}
 	s88Sensorstates[stateIdx] = state ?
 		s88Sensorstates[stateIdx] | stateMask :
 		s88Sensorstates[stateIdx] & ~stateMask;
 
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
+	s88ProcessedMicros = lastS88Micros;
+	int slot = findSensor(sensorId);
+	if (slot >= 0) {
+		debounceSensor(slot, state, skipOverride, lastS88Micros);
+	}
+}
 
-		if (s.sensorId != sensorId) {
-			continue;
-		}
-		if (s.overriden && skipOverride) {
-			s.s88State = state;
-			continue;
-		}
-		long l;
+unsigned long s88FrameMicros() {
+#ifdef __s88_deferred
+	return s88ProcessedMicros;
+#else
+	noInterrupts();
+	unsigned long t = s88ProcessedMicros;
+	interrupts();
+	return t;
+#endif
+}
 
-		if (s.changing) {
-			l = lastS88Millis & 0xffff;
-			if (l < s.stableFrom) {
-				l += 0x10000;
-			}
-			l = l - s.stableFrom;
-		} else {
-			l = 0;
+unsigned long s88EdgeMicros(int sensorId) {
+	int slot = findSensor(sensorId);
+	if (slot < 0) {
+		return 0;
+	}
+#ifdef __s88_deferred
+	return sensors.stableFrom[slot];
+#else
+	noInterrupts();
+	unsigned long t = sensors.stableFrom[slot];
+	interrupts();
+	return t;
+#endif
+}
+
+void s88TimingChanged() {
+#ifdef __s88_vertical_debounce
+	s88ThresholdsDirty = true;
+#endif
+}
+
+#ifdef __s88_vertical_debounce
+/**
+ * Updates the sensor from the vertical debounce result for its bus bit. The debounced
+ * state is reported only if 'report' is set, that is when it flipped or the sensor is new.
+ */
+void applyDebounced(byte i, boolean state, boolean debounced, boolean report, unsigned long now) {
+	slotmask_t mask = sensors.bit(i);
+	if (state != ((sensors.s88State & mask) != 0)) {
+#ifdef __s88_sensor_stats
+		sensorStatsEdge(i, state, (sensors.reportState & mask) != 0, now);
+#endif
+		sensors.stableFrom[i] = now;
+	}
+	sensors.assign(sensors.s88State, i, state);
+	if (sensors.overriden & mask) {
+		return;
+	}
+	if (report && (debounced != ((sensors.reportState & mask) != 0))) {
+		if (traceMask & traceDebounce) {
+			trace(traceTrigger, sensors.sensorId[i], debounced, (now - sensors.stableFrom[i]) / 1000);
 		}
-		if (state == s.reportState) {
-			if (debugS88Debounce) {
-				if (s.changing) {
-					Serial.print(F("Sensor ")); Serial.print(sensorId); Serial.print(F(" reset after ")); Serial.println(l);
-				}
-			}
-			s.s88State = state;
-			s.changing = false;
-			return;
+		sensors.assign(sensors.reportState, i, debounced);
+		debouncedChange(i, now);
+	}
+	sensors.assign(sensors.changing, i, state != ((sensors.reportState & mask) != 0));
+}
+#endif
+
+#ifdef __s88_deferred
+boolean s88AcquireFrame(S88Frame& frame) {
+	// once held, LOAD leaves the complete buffer alone
+	s88FrameHeld = true;
+	if (!s88FrameReady) {
+		s88FrameHeld = false;
+		return false;
+	}
+	s88FrameReady = false;
+	byte idx = s88ShiftFrame ^ 1;
+	frame.bits = s88FrameBuffers[idx];
+	frame.loadMicros = s88FrameLoadMicros[idx];
+	return true;
+}
+
+void s88ReleaseFrame() {
+	s88FrameHeld = false;
+}
+
+/**
+ * Slots of the defined sensors for the bits set in 'mask' of the frame byte 'index'.
+ */
+slotmask_t sensorsOf(byte index, byte mask) {
+	slotmask_t slots = 0;
+	const byte* ids = sensorSlots + 1 + index * 8;
+	while (mask) {
+		byte b = __builtin_ctz(mask);
+		mask &= mask - 1;
+		byte slot = ids[b];
+		if (slot > 0) {
+			slots |= ((slotmask_t)1) << (slot - 1);
 		}
-		int deb = state ? s.upDebounceTime() : s.downDebounceTime();
-		if (state == s.s88State) {
-			if (!s.changing) {
-				return;
+	}
+	return slots;
+}
+
+inline boolean frameBit(const byte* bits, int sensorId) {
+	return (bits[(sensorId - 1) / 8] & (1 << ((sensorId - 1) % 8))) != 0;
+}
+
+/**
+ * Consumes the frame completed by the last LOAD: updates the bus state and
+ * debounces the sensors. Runs in the main loop. Only sensors whose bit changed since
+ * the previous frame, or which wait for their debounce, are processed; a quiet frame
+ * costs just the XOR with the previous one.
+ */
+void s88ProcessFrame() {
+	S88Frame frame;
+	if (!s88AcquireFrame(frame)) {
+		return;
+	}
+	s88ProcessedMicros = frame.loadMicros;
+	boolean changed = false;
+	slotmask_t work = 0;
+	byte frameBytes = s88FrameBytes();
+	for (byte bus = 0; bus < s88BusCount; bus++) {
+		byte end = bus * s88BusMaxSize + frameBytes;
+		for (byte i = bus * s88BusMaxSize; i < end; i++) {
+			byte x = frame.bits[i] ^ s88Sensorstates[i];
+			if (x == 0) {
+				continue;
 			}
-			if (l >= deb) {
-				if (debugS88Debounce) {
-					Serial.print(F("Sensor ")); Serial.print(sensorId); Serial.print(F(" TRIGGER to ")); Serial.print(state);
-					Serial.print(F(" after ")); Serial.println(l);
+			changed = true;
+			s88Sensorstates[i] = frame.bits[i];
+			work |= sensorsOf(i, x);
+#ifdef __s88_calibration
+			if (s88Calibrating) {
+				for (byte b = 0; b < 8; b++) {
+					if (x & (1 << b)) {
+						calibrationEdge(i * 8 + b + 1, (frame.bits[i] >> b) & 1, frame.loadMicros);
+					}
 				}
-				s.changing = false;
-				s.triggerChange = true;
-				s.reportState = state;
-			} else if (debugS88Debounce && s.changing) {
-				Serial.print(F("Sensor ")); Serial.print(sensorId); Serial.print(F( "steady: ")); Serial.println(l);
 			}
-		} else if (millisQuantum > deb) {
-			if (debugS88Debounce) {
-				Serial.print(F("Sensor ")); Serial.print(sensorId); Serial.print(F(" TRIGGER to ")); Serial.println(state);
-			}
-			s.s88State = state;
-			s.changing = false;
-			s.triggerChange = true;
-			s.reportState = state;
-			s.stableFrom = lastS88Millis & 0xffff;
-		} else {
-			s.s88State = state;
-			s.changing = true;
-			s.stableFrom = lastS88Millis & 0xffff;
-			if (debugS88Debounce) {
-				Serial.print(F("Sensor ")); Serial.print(sensorId); Serial.print(F(" changing to "));
-				Serial.print(state); Serial.print(F(" at millis ")); Serial.println(s.stableFrom);
+#endif
+			if (traceMask & traceBus) {
+				trace(traceByte, i, s88Sensorstates[i], 0);
 			}
 		}
 	}
+	s88ReleaseFrame();
+	if (changed) {
+		s88BusChanged = true;
+	}
+#ifdef __s88_vertical_debounce
+	if (!(changed || s88DebouncePending || s88ChangingSlots)) {
+		return;
+	}
+	if (s88ThresholdsDirty || (s88ThresholdQuantum != millisQuantum)) {
+		s88ThresholdsDirty = false;
+		s88ThresholdQuantum = millisQuantum;
+		verticalDebounceThresholds(millisQuantum);
+	}
+	s88lane_t flipped[s88Lanes];
+	// the lanes up to the end of the last bus; bytes between the buses just stay zero
+	byte usedBytes = (s88BusCount - 1) * s88BusMaxSize + frameBytes;
+	byte lanes = (usedBytes + sizeof(s88lane_t) - 1) / sizeof(s88lane_t);
+	s88DebouncePending = verticalDebounce((const s88lane_t*)s88Sensorstates, flipped, lanes);
+	const byte* flippedBits = (const byte*)flipped;
+	for (byte i = 0; i < usedBytes; i++) {
+		if (flippedBits[i] != 0) {
+			work |= sensorsOf(i, flippedBits[i]);
+		}
+	}
+	slotmask_t fresh = s88ChangingSlots;
+	s88ChangingSlots = 0;
+	work |= fresh;
+	while (work) {
+		byte i = lowestSlot(work);
+		slotmask_t mask = sensors.bit(i);
+		work &= ~mask;
+		byte id = sensors.sensorId[i];
+		boolean report = ((fresh & mask) != 0) || frameBit(flippedBits, id);
+		applyDebounced(i, frameBit(s88Sensorstates, id), frameBit((const byte*)s88DebouncedState, id), report, frame.loadMicros);
+	}
+#else
+	work |= s88ChangingSlots;
+	while (work) {
+		byte i = lowestSlot(work);
+		work &= ~sensors.bit(i);
+		debounceSensor(i, frameBit(s88Sensorstates, sensors.sensorId[i]), true, frame.loadMicros);
+	}
+	s88ChangingSlots = sensors.changing;
+#endif
+}
+#endif
+
+S88Config s88Config;
+
+#ifdef __s88_deferred
+/**
+ * The last 8 bits shifted in from a chain of 'clocks' bits.
+ */
+inline byte lastModule(const byte* bus, int clocks) {
+	int p = clocks - 8;
+	byte shift = p % 8;
+	byte v = bus[p / 8] >> shift;
+	return shift ? v | (bus[p / 8 + 1] << (8 - shift)) : v;
+}
+
+/**
+ * Checks the frame just shifted in before LOAD hands it over. Runs in the interrupt.
+ */
+boolean frameIntact(const byte* frame, int clocks) {
+	if (s88DetectedClocks > 0 && clocks != s88DetectedClocks) {
+		s88BadLengthFrames++;
+		return false;
+	}
+	if (!s88Config.sentinel) {
+		return true;
+	}
+#ifdef __s88_virtual_output
+	// the sentinel ends the physical chain, the virtual modules follow it
+	if (s88Config.physicalModules > 0 && clocks > s88Config.physicalModules * 8) {
+		clocks = s88Config.physicalModules * 8;
+	}
+#endif
+	if (clocks < 8 || clocks > s88BusMaxSize * 8) {
+		s88BadSentinelFrames++;
+		return false;
+	}
+	for (byte bus = 0; bus < s88BusCount; bus++) {
+		if (lastModule(frame + bus * s88BusMaxSize, clocks) != s88Config.sentinelPattern) {
+			s88BadSentinelFrames++;
+			return false;
+		}
+	}
+	return true;
 }
+#endif
+
+/**
+ * LOADs since millisQuantum was last refreshed from the average period.
+ */
+byte s88QuantumFrames = 0;
 
-long prevS88 = 0;
-long cummulativeS88 = 0;
-long s88IntCount = 0;
+int s88BusClocks() {
+	noInterrupts();
+	int c = s88DetectedClocks;
+	interrupts();
+	return c;
+}
 
+byte s88FrameBytes() {
+	return s88DetectedBytes;
+}
+
+/**
+ * Learns the number of clocks the command station sends per LOAD. Runs in the interrupt.
+ */
+void detectBusLength(int clocks) {
+	if (clocks != s88LastClocks) {
+		s88LastClocks = clocks;
+		s88SameClocks = 0;
+		return;
+	}
+	if (s88SameClocks < s88LengthConfirm) {
+		s88SameClocks++;
+	}
+	if (s88SameClocks < s88LengthConfirm) {
+		return;
+	}
+	if (clocks != s88DetectedClocks) {
+		s88DetectedClocks = clocks;
+		int bytes = (clocks + 7) / 8;
+		s88DetectedBytes = (bytes == 0 || bytes > s88BusMaxSize) ? s88BusMaxSize : bytes;
+	}
+}
+
+#ifdef __s88_spi
+/**
+ * Restarts the SPI slave, so the next CLOCK is the first bit of a byte even if the
+ * previous frame ended with a partial one or an edge was missed.
+ */
+inline void s88SpiResync() {
+	SPCR &= ~_BV(SPE);
+	SPCR |= _BV(SPE);
+	SPDR = 0;
+}
+
+/**
+ * A bus byte was shifted in. Nothing is sent out, see __s88_spi.
+ */
+ISR(SPI_STC_vect) {
+	byte b = SPDR;
+	bitCounter += 8;
+	if (byteIndex < s88MaxSize_bytes) {
+		s88FrameBuffers[s88ShiftFrame][byteIndex++] = b;
+	}
+}
+#endif
 
 /***************************************************************************
  * Interrupt 0 LOAD.
  */
 void s88LoadInt() {
-  bitCounter = 0 ;
-  lastS88Millis = millis();
-  if (prevS88 > 0) {
-	  s88IntCount++;
-	  if ((s88IntCount % 100) == 0) {
-		  millisQuantum = cummulativeS88 / s88IntCount;
-		  cummulativeS88 = 0;
-		  s88IntCount = 1;
+  lastS88Micros = micros();
+  s88TimingLoad(lastS88Micros, bitCounter);
+  if (++s88QuantumFrames >= 100) {
+	  s88QuantumFrames = 0;
+	  long q = s88TimingAverageIsr() / 1000;
+	  if (q > 0) {
+		  millisQuantum = q;
 	  }
-	  cummulativeS88 += (lastS88Millis - prevS88);
   }
-  prevS88 = lastS88Millis;
+  detectBusLength(bitCounter);
+#ifdef __s88_deferred
+  byte* shiftBuffer = s88FrameBuffers[s88ShiftFrame];
+  // flush the incomplete last byte, aligning its first bit to bit 0
+  byte rem = bitCounter % 8;
+  if (rem > 0 && byteIndex < s88BusMaxSize) {
+	  shiftBuffer[byteIndex] = data >> (8 - rem);
+#ifdef __s88_second_bus
+	  shiftBuffer[s88BusMaxSize + byteIndex] = data2 >> (8 - rem);
+#endif
+	  byteIndex++;
+  }
+  if (byteIndex < s88DetectedBytes) {
+	  memset(shiftBuffer + byteIndex, 0, s88DetectedBytes - byteIndex);
+#ifdef __s88_second_bus
+	  memset(shiftBuffer + s88BusMaxSize + byteIndex, 0, s88DetectedBytes - byteIndex);
+#endif
+  }
+  if (!frameIntact(shiftBuffer, bitCounter)) {
+	  // keep the last good frame; the buffer is overwritten by the next one
+  } else if (s88FrameHeld) {
+	  // the main loop still reads the complete frame; this one is lost
+	  s88FramesDropped++;
+  } else {
+	  s88FrameLoadMicros[s88ShiftFrame] = lastS88Micros;
+	  s88ShiftFrame ^= 1;
+	  s88FrameReady = true;
+	  s88FramesAccepted++;
+  }
+  data = 0;
+#ifdef __s88_second_bus
+  data2 = 0;
+#endif
+#ifdef __s88_spi
+  s88SpiResync();
+#endif
+#endif
+  bitCounter = 0;
   byteIndex = 0;
 }
 
@@ -322,42 +1039,69 @@ void s88LoadInt() {
  * Interrupt 1 CLOCK.
  */
 void s88ClockInt() {
-  int xferBit = (bitCounter++) % 8;
-
   // read input
-  int x = digitalRead(DATA_IN);
-
+  boolean x = FastPin<DATA_IN>::read();
+#ifdef __s88_second_bus
+  boolean x2 = FastPin<DATA_IN_2>::read();
+#endif
+
+#if defined(__s88_virtual_output)
+  // send out the same bit, or the virtual modules after the physical chain
+  FastPin<DATA_OUT>::write(s88OutputBit(bitCounter, x));
+#elif !defined(__s88_spi)
   // send out the same bit
-  digitalWrite(DATA_OUT, x) ;
-
-  storeS88Bit(bitCounter, x > 0, true);
-
-  if (debugS88Low) {
-    if ((bitCounter  % 8) == 0 && bitCounter > 7 && data != 0) {
-      Serial.print(F("S88 read byte: ")); Serial.print((bitCounter - 1)/ 8 + 65); Serial.print(F(" = "));
-      Serial.println(data);
-    }
+  FastPin<DATA_OUT>::write(x);
+#endif
+
+#ifdef __s88_deferred
+  // just assemble the byte, the rest is done by s88ProcessFrame()
+  data >>= 1;
+  if (x) {
+	  data |= 0x80;
+  }
+#ifdef __s88_second_bus
+  data2 >>= 1;
+  if (x2) {
+	  data2 |= 0x80;
   }
+#endif
+  if ((++bitCounter % 8) == 0 && byteIndex < s88BusMaxSize) {
+	  s88FrameBuffers[s88ShiftFrame][byteIndex] = data;
+#ifdef __s88_second_bus
+	  s88FrameBuffers[s88ShiftFrame][s88BusMaxSize + byteIndex] = data2;
+#endif
+	  byteIndex++;
+  }
+#else
+  bitCounter++;
+  if (bitCounter > s88BusMaxSize * 8) {
+	  return;
+  }
+  storeS88Bit(bitCounter, x, true);
+#ifdef __s88_second_bus
+  storeS88Bit(s88BusMaxSize * 8 + bitCounter, x2, true);
+#endif
+
+  if ((traceMask & traceBus) && (bitCounter % 8) == 0) {
+    byte idx = (bitCounter - 1) / 8;
+    trace(traceByte, idx, s88Sensorstates[idx], 0);
+  }
+#endif
 }
 
 void setS88Sensor(int sensor, int state) {
 }
 
 int tryReadS88(int sensor) {
-	if (sensor < 0 || sensor >= (s88MaxSize * 8)) {
+	int slot = findSensor(sensor);
+	if (slot < 0) {
 		return -1;
 	}
-	for (int i = 0; i < sensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == sensor) {
-			if (s.suspended) {
-				return s.suspendedState ? 1 : 0;
-			} else {
-				return s.reportState ? 1 : 0;
-			}
-		}
+	if (sensors.test(sensors.suspended, slot)) {
+		return sensors.test(sensors.suspendedState, slot) ? 1 : 0;
+	} else {
+		return sensors.test(sensors.reportState, slot) ? 1 : 0;
 	}
-	return -1;
 }
 
 boolean readS88(int sensor) {
@@ -365,83 +1109,119 @@ boolean readS88(int sensor) {
 	return r > 0;
 }
 
+slotmask_t s88Snapshot() {
+	noInterrupts();
+	slotmask_t snapshot = (sensors.reportState & ~sensors.suspended) | (sensors.suspendedState & sensors.suspended);
+	interrupts();
+	return snapshot;
+}
+
+slotmask_t s88EventSnapshot() {
+	return s88Delivering ? s88EventState : s88Snapshot();
+}
+
 void suspendS88(int sensorId) {
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == sensorId) {
-			s.suspendedState = s.reportState;
-			s.suspended = true;
-			break;
-		}
+	int slot = findSensor(sensorId);
+	if (slot >= 0) {
+		sensors.assign(sensors.suspendedState, slot, sensors.test(sensors.reportState, slot));
+		sensors.suspended |= sensors.bit(slot);
 	}
 }
 
 void resumeS88(int sensorId) {
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == sensorId) {
-			s.suspended = false;
-			break;
-		}
+	int slot = findSensor(sensorId);
+	if (slot >= 0) {
+		sensors.suspended &= ~sensors.bit(slot);
 	}
 }
 
 
 void overrideS88(int sensorId, boolean override, boolean state) {
-	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		if (s.sensorId == sensorId) {
-			boolean change;
-			if (override) {
-				change = tryReadS88(sensorId) != (state ? 1 : 0);
-				s.overriden = true;
-				s.reportState = state;
-				if (debugS88) {
-					Serial.print(F("Sensor ")); Serial.print(sensorId);
-					Serial.print(F(" set to ")); Serial.println(state);
-				}
-			} else {
-				change = s.reportState != s.s88State;
-				s.reportState = s.s88State;
-				if (debugS88) {
-					Serial.print(F("Sensor ")); Serial.print(sensorId);
-					Serial.println(F(" released"));
-				}
-			}
-			if (change) {
-				if (debugS88) {
-					Serial.println(F("Trigger."));
-				}
-				s.triggerChange = true;
-			}
-			return;
+	int slot = findSensor(sensorId);
+	if (slot < 0) {
+		Serial.print(F("No sensor: ")); Serial.println(sensorId);
+		return;
+	}
+	boolean change;
+	if (override) {
+		change = tryReadS88(sensorId) != (state ? 1 : 0);
+		noInterrupts();
+		sensors.overriden |= sensors.bit(slot);
+		sensors.assign(sensors.reportState, slot, state);
+		interrupts();
+		if (debugS88) {
+			Serial.print(F("Sensor ")); Serial.print(sensorId);
+			Serial.print(F(" set to ")); Serial.println(state);
+		}
+	} else {
+		noInterrupts();
+		boolean s88State = sensors.test(sensors.s88State, slot);
+		change = sensors.test(sensors.reportState, slot) != s88State;
+		sensors.assign(sensors.reportState, slot, s88State);
+		interrupts();
+		if (debugS88) {
+			Serial.print(F("Sensor ")); Serial.print(sensorId);
+			Serial.println(F(" released"));
 		}
 	}
-	Serial.print(F("No sensor: ")); Serial.println(sensorId);
+	if (change) {
+		if (debugS88) {
+			Serial.println(F("Trigger."));
+		}
+		noInterrupts();
+		pushEvent(slot, micros());
+		interrupts();
+		s88PendingSlots |= sensors.bit(slot);
+	}
 }
 
 void resetAllSensors() {
 	Serial.println(F("Resetting sensor defs"));
-	for (int i = 0; i < maxSensorCount; i++) {
-		sensors[i] = Sensor();
-	}
+	noInterrupts();
+	sensors.clearAll();
+#ifdef __s88_sensor_stats
+	sensorStatsReset();
+#endif
+#ifndef __s88_deferred
+	s88IsrPendingSlots = 0;
+#endif
+	s88OverflowSlots = 0;
+	interrupts();
 	sensorCount = 0;
+	s88PendingSlots = s88ChangingSlots = 0;
+	rebuildSensorSlots();
+	s88TimingChanged();
 }
 
 
+/**
+ * The sensor flags byte in EEPROM: bit 0 = trigger sensor; bit 7 marks a frame filter with
+ * (window - 1) in bits 1-3 and (votes - 1) in bits 4-6. Older configurations hold just 0 or 1.
+ */
+const byte eepromTriggerFlag = 0x01;
+const byte eepromFilterFlag = 0x80;
+
 boolean loadEEPROMSensors() {
 	int addr = eepromSensors;
 	int checksum = 0;
 	boolean allzero;
 	sensorCount = 0;
+	sensors.clearAll();
+#ifdef __s88_sensor_stats
+	sensorStatsReset();
+#endif
 	for (int i = 0; i < maxSensorCount; i++) {
-		Sensor& s = sensors[i];
-		s = Sensor();
-		s.sensorId = eepromReadByte(addr, checksum, allzero);
-		s.triggerSensor = eepromReadByte(addr, checksum, allzero);
-		s.sensorUpDebounce = eepromReadInt(addr, checksum, allzero);
-		s.sensorDownDebounce = eepromReadInt(addr, checksum, allzero);
-		if (s.sensorId > 0) {
+		sensors.sensorId[i] = eepromReadByte(addr, checksum, allzero);
+		byte flags = eepromReadByte(addr, checksum, allzero);
+		sensors.assign(sensors.triggerSensor, i, flags & eepromTriggerFlag);
+#ifdef __s88_frame_filter
+		if (flags & eepromFilterFlag) {
+			sensors.frameFilter[i] = ((((flags >> 4) & 0x07) + 1) << 4) | (((flags >> 1) & 0x07) + 1);
+		}
+#endif
+		sensors.upDebounce[i] = eepromReadInt(addr, checksum, allzero);
+		sensors.downDebounce[i] = eepromReadInt(addr, checksum, allzero);
+		if (sensors.sensorId[i] > 0) {
 			sensorCount++;
 		}
 	}
@@ -451,6 +1231,8 @@ boolean loadEEPROMSensors() {
 		Serial.println(F("Sensor corrupted."));
 		resetAllSensors();
 	}
+	rebuildSensorSlots();
+	s88TimingChanged();
 	return true;
 }
 
@@ -459,30 +1241,61 @@ void saveEEPROMSensors() {
 	int addr = eepromSensors;
 	int checksum = 0;
 	for (int i = 0; i < maxSensorCount; i++) {
-		const Sensor& s = sensors[i];
-
-		eepromWriteByte(addr++, s.sensorId, checksum);
-		eepromWriteByte(addr++, s.triggerSensor, checksum);
-		addr = eepromWriteInt(addr, s.sensorUpDebounce, checksum);
-		addr = eepromWriteInt(addr, s.sensorDownDebounce, checksum);
+		eepromWriteByte(addr++, sensors.sensorId[i], checksum);
+		byte flags = sensors.test(sensors.triggerSensor, i) ? eepromTriggerFlag : 0;
+#ifdef __s88_frame_filter
+		if (sensors.frameFilter[i]) {
+			flags |= eepromFilterFlag | ((sensors.filterVotes(i) - 1) << 4) | ((sensors.filterWindow(i) - 1) << 1);
+		}
+#endif
+		eepromWriteByte(addr++, flags, checksum);
+		addr = eepromWriteInt(addr, sensors.upDebounce[i], checksum);
+		addr = eepromWriteInt(addr, sensors.downDebounce[i], checksum);
 	}
 	int tmp = 0;
 	eepromWriteInt(addr, checksum, tmp);
 }
 
 void s88Status() {
+	int clocks = s88BusClocks();
+	Serial.print(F("S88 bus length: "));
+	if (clocks > 0) {
+		Serial.print(clocks); Serial.print(F(" bits, ")); Serial.print(s88FrameBytes()); Serial.print(F(" modules"));
+		if (s88BusCount > 1) {
+			Serial.print(F(" per bus"));
+		}
+		Serial.println();
+	} else {
+		Serial.println(F("unknown"));
+	}
+#ifdef __s88_deferred
+	noInterrupts();
+	unsigned long accepted = s88FramesAccepted;
+	unsigned int badLength = s88BadLengthFrames;
+	unsigned int badSentinel = s88BadSentinelFrames;
+	unsigned int dropped = s88FramesDropped;
+	interrupts();
+	Serial.print(F("S88 frames checked: ")); Serial.print(accepted);
+	Serial.print(F(" accepted, ")); Serial.print(badLength + badSentinel);
+	Serial.print(F(" rejected (length ")); Serial.print(badLength);
+	Serial.print(F(", sentinel ")); Serial.print(badSentinel);
+	Serial.print(F("), ")); Serial.print(dropped); Serial.println(F(" dropped"));
+	if (s88Config.sentinel) {
+		Serial.print(F("S88 sentinel: ")); Serial.println(s88Config.sentinelPattern, HEX);
+	}
+#endif
+	s88EventStatus();
 	Serial.println(F("Sensor status:"));
 	for (int i = 0; i < maxSensorCount; i++) {
-		const Sensor& s = sensors[i];
-		if (s.sensorId == 0) {
+		if (!sensors.isDefined(i)) {
 			continue;
 		}
-		Serial.print(s.sensorId);
-		Serial.print(F(":\tr=")); Serial.print(s.reportState);
-		Serial.print(F(":\ts=")); Serial.print(s.s88State);
-		Serial.print(F(":\tt=")); Serial.print(s.triggerChange);
-		Serial.print(F(":\to=")); Serial.print(s.overriden);
-		Serial.print(F(":\tfrom=")); Serial.print(s.stableFrom);
+		Serial.print(sensors.sensorId[i]);
+		Serial.print(F(":\tr=")); Serial.print(sensors.test(sensors.reportState, i));
+		Serial.print(F(":\ts=")); Serial.print(sensors.test(sensors.s88State, i));
+		Serial.print(F(":\tt=")); Serial.print(sensors.test(s88PendingSlots, i));
+		Serial.print(F(":\to=")); Serial.print(sensors.test(sensors.overriden, i));
+		Serial.print(F(":\tfrom=")); Serial.print(sensors.stableFrom[i]);
 		Serial.println();
 	}
 }
@@ -528,10 +1341,18 @@ void s88MonitorCallback(char c) {
 	}
 }
 
+/**
+ * Frame byte shown in the monitor column 'c': the buses follow each other.
+ */
+byte s88MonitorByte(byte c, byte bytes) {
+	return (c / bytes) * s88BusMaxSize + (c % bytes);
+}
+
 void s88MonitorDoPrint() {
 	Serial.print((char)0x0d);
-	for (byte i = 0; i < sizeof(s88Sensorstates); i++) {
-		byte x = s88Sensorstates[i];
+	byte bytes = s88FrameBytes();
+	for (byte c = 0; c < s88BusCount * bytes; c++) {
+		byte x = s88Sensorstates[s88MonitorByte(c, bytes)];
 		if (x < 0x10) {
 			Serial.print('0');
 		}
@@ -551,15 +1372,72 @@ void cmdMonitorS88() {
 	s88MonitorActive = true;
 	charModeCallback = &s88MonitorCallback;
 
-	Serial.println(F("                                  100                                   200                     "));
-	Serial.println(F("00 08 16 24 32 40 48 56 64 72 80 96 04 12 20 28 36 44 52 60 68 76 84 92 00 08 16 24 32 40 48 56"));
-	for (byte i = 0; i < sizeof(s88Sensorstates); i++) Serial.print(F("---")); Serial.println();
+	byte bytes = s88FrameBytes();
+	byte columns = s88BusCount * bytes;
+	// hundreds above the column where they start, then the first bit of each module
+	int prev = 0;
+	for (byte c = 0; c < columns; c++) {
+		int first = s88MonitorByte(c, bytes) * 8;
+		if (c > 0 && (first / 100) != (prev / 100)) {
+			Serial.print((first / 100) * 100);
+		} else {
+			Serial.print(F("   "));
+		}
+		prev = first;
+	}
+	Serial.println();
+	for (byte c = 0; c < columns; c++) {
+		int n = (s88MonitorByte(c, bytes) * 8) % 100;
+		if (n < 10) {
+			Serial.print('0');
+		}
+		Serial.print(n); Serial.print(' ');
+	}
+	Serial.println();
+	for (byte c = 0; c < columns; c++) Serial.print(F("---")); Serial.println();
 	s88MonitorDoPrint();
 }
 
 
+#ifdef __s88_deferred
+/**
+ * SNT:n expects the value n on the last module of each chain; SNT alone turns the check off.
+ */
+void cmdSentinel() {
+	int n = nextNumber();
+	if (n < 0) {
+		s88Config.sentinel = false;
+		Serial.println(F("Sentinel off."));
+		return;
+	}
+	// a dead or shorted DATA line reads all 0s or 1s
+	if (n == 0 || n >= 0xff) {
+		Serial.println(F("Pattern must mix 0s and 1s."));
+		return;
+	}
+	noInterrupts();
+	s88Config.sentinelPattern = n;
+	s88Config.sentinel = true;
+	interrupts();
+	Serial.print(F("Sentinel: ")); Serial.println(n, HEX);
+}
+#endif
+
+void loadEEPROMS88Config() {
+	if (!eeBlockRead(0x88, eepromS88Config, &s88Config, sizeof(s88Config))) {
+		s88Config = S88Config();
+	}
+}
+
+void saveEEPROMS88Config() {
+	eeBlockWrite(0x88, eepromS88Config, &s88Config, sizeof(s88Config));
+}
+
 void setupS88Support() {
 	registerLineCommand("SEN", &cmdSetSensors);
+#ifdef __s88_deferred
+	registerLineCommand("SNT", &cmdSentinel);
+#endif
 	registerLineCommand("RLS", &cmdReleaseSensors);
 	registerLineCommand("S88", &cmdPrintSensors);
 	registerLineCommand("S8M", &cmdMonitorS88);
@@ -567,13 +1445,29 @@ void setupS88Support() {
 	pinMode(LOAD_INT_0, INPUT_PULLUP) ;
 	attachInterrupt(digitalPinToInterrupt(LOAD_INT_0), s88LoadInt, RISING);
 
+#ifdef __s88_spi
+	pinMode(CLOCK_SCK, INPUT) ;
+	pinMode(SPI_SS, INPUT) ;
+#else
 	pinMode(CLOCK_INT_1, INPUT_PULLUP) ;
 	attachInterrupt(digitalPinToInterrupt(CLOCK_INT_1), s88ClockInt, RISING) ;
+#endif
 
 	pinMode(DATA_IN, INPUT) ;
+#ifdef __s88_second_bus
+	pinMode(DATA_IN_2, INPUT) ;
+#endif
 
+#ifndef __s88_spi
 	pinMode(DATA_OUT, OUTPUT) ;
 	digitalWrite(DATA_OUT, LOW) ;
+#endif
+
+#ifdef __s88_spi
+	// slave, mode 0 (sample on the rising CLOCK), LSB first: the first bus bit lands in bit 0
+	SPCR = _BV(SPE) | _BV(SPIE) | _BV(DORD);
+	SPDR = 0;
+#endif
 }
 
 boolean s88ModuleHandler(ModuleCmd cmd) {
@@ -582,9 +1476,11 @@ boolean s88ModuleHandler(ModuleCmd cmd) {
     	setupS88Support();
       break;
     case eepromLoad:
+      loadEEPROMS88Config();
       return loadEEPROMSensors();
     case eepromSave:
       saveEEPROMSensors();
+      saveEEPROMS88Config();
       break;
     case status:
 		s88Status();
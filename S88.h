@@ -10,13 +10,90 @@
 
 #include "PinOut.h"
 
+/**
+ * If defined, the CLOCK interrupt only assembles bus bytes into a frame; debounce
+ * and sensor updates run in the main loop on the frame completed by LOAD.
+ * Undefine to process each bit directly in the interrupt.
+ */
+#define __s88_deferred
+
+/**
+ * If defined (requires __s88_deferred), sensors are debounced by the vertical counter
+ * engine in S88Debounce.cpp, which handles all bits of a frame with a few word operations
+ * per lane instead of timing each sensor separately. Debounce times are converted to
+ * frame counts using the measured bus period.
+ */
+#undef __s88_vertical_debounce
+
+/**
+ * If defined, the CAL command measures the bus noise of each sensor and proposes
+ * debounce times (S88Calibration.cpp). Costs 8 bytes of RAM per sensor slot.
+ */
+#undef __s88_calibration
+
+/**
+ * If defined, a sensor may be debounced by a frame filter instead of the time debounce:
+ * the sensor reports a change once K of the last N bus frames show the new state (N = K
+ * requires K consecutive frames). Costs 2 bytes of RAM per sensor slot. The vertical
+ * debounce is already frame based and does not support the filter.
+ */
+#undef __s88_frame_filter
+
+/**
+ * If defined, the debounce keeps activity counters for each sensor, printed by SST
+ * (S88Stats.cpp). Costs 22 bytes of RAM per sensor slot.
+ */
+#undef __s88_sensor_stats
+
+/**
+ * If defined, the controller appends virtual modules after the physical chain, which
+ * publish the loop states and relays to the command station (S88Output.cpp). Costs
+ * maxLoopCount + 1 bytes of RAM.
+ */
+#undef __s88_virtual_output
+
+#if defined(__s88_virtual_output) && defined(__s88_spi)
+#error "__s88_virtual_output is not supported with __s88_spi"
+#endif
+#if defined(__s88_frame_filter) && defined(__s88_vertical_debounce)
+#error "__s88_frame_filter is not supported with __s88_vertical_debounce"
+#endif
+#if defined(__s88_spi) && defined(__s88_second_bus)
+#error "__s88_second_bus is not supported with __s88_spi"
+#endif
+#if defined(__s88_spi) && !defined(__s88_deferred)
+#error "__s88_spi requires __s88_deferred"
+#endif
+
 const int s88MaxSize	  = 32;		   // max number of 8bit S88 modules
 
 const int s88MaxSize_bytes = s88MaxSize;
 
+#ifdef __s88_second_bus
+const int s88BusCount = 2;
+#else
+const int s88BusCount = 1;
+#endif
+
+/**
+ * Max modules on one bus. Bus 'n' occupies frame bytes from n * s88BusMaxSize, so
+ * the second bus sensors are numbered from s88BusMaxSize * 8 + 1.
+ */
+const int s88BusMaxSize = s88MaxSize / s88BusCount;
+
 
 const int maxSensorCount  = 8 * 3;	   // maximum number of sensors
-const int maxSensorId = s88MaxSize * 8;
+
+/**
+ * Highest usable sensor ID. Sensor IDs are kept in a byte (sensor table, events, trace),
+ * so the last bit of a full 32 module bus cannot be a sensor.
+ */
+const int maxSensorId = s88MaxSize * 8 > 255 ? 255 : s88MaxSize * 8;
+
+/**
+ * Set of sensor table slots, one bit per slot; must be able to hold maxSensorCount bits.
+ */
+typedef unsigned long slotmask_t;
 
 /**
  * Milliseconds the sensor's state must hold in order to report a change.
@@ -24,14 +101,138 @@ const int maxSensorId = s88MaxSize * 8;
 extern int sensorDebounceMillis;
 
 /**
- * Callback to be called if the sensor's state changes.
+ * A debounced change of a sensor.
+ */
+struct SensorEvent {
+	byte sensorId;
+
+	/**
+	 * The reported (debounced) state after the change.
+	 */
+	boolean state;
+
+	/**
+	 * Micros of the frame which completed the change, see s88FrameMicros().
+	 */
+	unsigned long frameMicros;
+};
+
+/**
+ * Capacity of the sensor event queue; must be a power of 2.
+ */
+const byte s88EventQueueSize = 16;
+
+/**
+ * Callback to be called if the sensor's state changes. Events come in the order
+ * the debounce produced them.
  */
-typedef void (*sensorChangeFunc)(int sensor, boolean state);
+typedef void (*sensorChangeFunc)(const SensorEvent& event);
 typedef int (*sensorIteratorFunc)(int sensorId, boolean triggerType);
 
 
 extern sensorChangeFunc sensorCallback;
 
+/**
+ * Callback to be called once per frame with all the sensors that changed in it, one bit
+ * per slot, after their events went to sensorCallback.
+ */
+typedef void (*sensorFrameFunc)(slotmask_t changed);
+
+extern sensorFrameFunc sensorFrameCallback;
+
+/**
+ * A complete S88 frame, as latched by the bus between two LOADs.
+ */
+struct S88Frame {
+	/**
+	 * Bus bits; sensor 1 is bit 0 of the first byte.
+	 */
+	const byte* bits;
+
+	/**
+	 * Micros at the LOAD which completed the frame.
+	 */
+	unsigned long loadMicros;
+};
+
+/**
+ * Bus options stored in EEPROM.
+ */
+struct S88Config {
+	/**
+	 * If set, the last module of each chain must read sentinelPattern, otherwise
+	 * the frame is rejected. A shifted or truncated frame moves other bits there.
+	 */
+	boolean sentinel;
+	byte sentinelPattern;
+
+	/**
+	 * Modules of the physical chain; the virtual output follows them. 0 = no virtual output.
+	 */
+	byte physicalModules;
+};
+
+extern S88Config s88Config;
+
+
+#ifdef __s88_deferred
+/**
+ * Hands the main loop the last complete frame, if it was not acquired yet. The frame
+ * stays stable until s88ReleaseFrame(); frames completed meanwhile are dropped.
+ */
+boolean s88AcquireFrame(S88Frame& frame);
+void s88ReleaseFrame();
+#endif
+
+#ifdef __s88_vertical_debounce
+/**
+ * Unit processed by the vertical debounce. A byte is the native AVR word, but any unsigned
+ * type dividing the frame size works.
+ */
+typedef byte s88lane_t;
+
+const int s88Lanes = s88MaxSize_bytes / sizeof(s88lane_t);
+
+/**
+ * Bit planes of the vertical counters; the debounce is capped at (2^planes - 1) frames.
+ */
+const int s88DebouncePlanes = 4;
+const int s88DebounceMaxFrames = (1 << s88DebouncePlanes) - 1;
+
+/**
+ * Debounced state of all bus bits.
+ */
+extern s88lane_t s88DebouncedState[];
+
+/**
+ * Advances the vertical counters of the first 'lanes' lanes by one frame. Bits which completed
+ * their debounce are flipped in s88DebouncedState and reported in 'flipped'. Returns true,
+ * if some bits still differ from the debounced state.
+ */
+boolean verticalDebounce(const s88lane_t* raw, s88lane_t* flipped, byte lanes);
+
+/**
+ * Recomputes the per-bit frame thresholds from the sensor timings.
+ */
+void verticalDebounceThresholds(long quantum);
+#endif
+
+/**
+ * Must be called after sensor debounce timings change.
+ */
+void s88TimingChanged();
+
+/**
+ * Number of clocks per LOAD detected on the bus, 0 if not known yet.
+ */
+int s88BusClocks();
+
+/**
+ * Number of frame bytes (modules) in use on each bus: the detected bus length, or
+ * s88BusMaxSize before the length is known.
+ */
+byte s88FrameBytes();
+
 void s88InLoop();
 void s88LoadInt();
 void s88ClockInt();
@@ -56,91 +257,221 @@ struct SensorTiming {
 
 extern SensorTiming defaultTiming;
 
-struct Sensor;
+/**
+ * Max window of the frame filter, in frames.
+ */
+const byte s88FilterMaxFrames = 8;
 
-struct SensorData {
-	unsigned int	sensorUpDebounce;
+/**
+ * Sensor table with N slots, stored as a structure of arrays. Each flag is a bitset
+ * with one bit per slot, so the flags of all sensors are tested or combined by single
+ * word operations (see slotmask_t); the timestamps, timeouts and IDs are kept in
+ * separate arrays. A slot is free if its sensorId is 0.
+ */
+template<int N> struct SensorTable {
+	/**
+	 * State reported from reading
+	 */
+	slotmask_t reportState;
 
-	unsigned int	sensorDownDebounce;
 	/**
-	 * The sensor number
+	 * State reported by S88, not necessarily stable
 	 */
-	byte sensorId;
+	slotmask_t s88State;
 
-	boolean triggerSensor;
+	slotmask_t suspendedState;
 
-	SensorData(const Sensor& from);
-};
+	slotmask_t suspended;
+
+	slotmask_t overriden;
 
-struct Sensor {
 	/**
-	 * State reported from reading
+	 * Sensors in transition
 	 */
-	boolean reportState : 1;
+	slotmask_t changing;
+
+	slotmask_t triggerSensor;
 
 	/**
-	 * State reported by S88, not necessarily stable
+	 * Slots holding a sensor.
 	 */
-	boolean s88State : 1;
+	slotmask_t defined;
 
 	/**
-	 * Should trigger a change notification
+	 * Micros of the frame which last changed the S88 state. Compare only differences
+	 * (micros() wraps after ~70 minutes).
 	 */
-	volatile boolean	triggerChange : 1;
+	unsigned long stableFrom[N];
 
 	/**
-	 *change is being processed
+	 * Debounce times set for the sensor, 0 = use defaultTiming.
 	 */
-	boolean	changeProcessing : 1;
-
-	boolean suspendedState : 1;
-
-	boolean suspended : 1;
+	unsigned int upDebounce[N];
+	unsigned int downDebounce[N];
 
 	/**
-	 *
+	 * The sensor number
 	 */
-	boolean overriden : 1;
+	byte sensorId[N];
 
+#ifdef __s88_frame_filter
 	/**
-	 * True, if the sensor is transitioning
+	 * Frame filter of the sensor: votes (K) in the high nibble, window (N) in the low one;
+	 * 0 = time debounce.
 	 */
-	boolean changing : 1;
-
-	boolean triggerSensor : 1;
+	byte frameFilter[N];
 
 	/**
-	 * Lowest 32 bits from millis of the last change of S88 state.
+	 * Bus state of the sensor in the recent frames, the last frame in bit 0.
 	 */
-	unsigned int	stableFrom = 0;
+	byte frameHistory[N];
+
+	byte filterVotes(byte slot) const { return frameFilter[slot] >> 4; }
+	byte filterWindow(byte slot) const { return frameFilter[slot] & 0x0f; }
+#endif
+
+	static inline slotmask_t bit(byte slot) {
+		return ((slotmask_t)1) << slot;
+	}
+
+	static inline boolean test(slotmask_t set, byte slot) {
+		return (set & bit(slot)) != 0;
+	}
 
-	unsigned int	sensorUpDebounce = 0;
+	static inline void assign(slotmask_t& set, byte slot, boolean v) {
+		if (v) {
+			set |= bit(slot);
+		} else {
+			set &= ~bit(slot);
+		}
+	}
+
+	boolean isDefined(byte slot) const { return sensorId[slot] != 0; }
 
-	unsigned int	sensorDownDebounce = 0;
 	/**
-	 * The sensor number
+	 * Sets up a fresh sensor in the slot.
 	 */
-	byte sensorId = 0;
+	void init(byte slot, byte id, boolean trigger) {
+		clear(slot);
+		sensorId[slot] = id;
+		defined |= bit(slot);
+		assign(triggerSensor, slot, trigger);
+	}
+
+	void clear(byte slot) {
+		slotmask_t keep = ~bit(slot);
+		reportState &= keep;
+		s88State &= keep;
+		suspendedState &= keep;
+		suspended &= keep;
+		overriden &= keep;
+		changing &= keep;
+		triggerSensor &= keep;
+		defined &= keep;
+		stableFrom[slot] = 0;
+		upDebounce[slot] = downDebounce[slot] = 0;
+		sensorId[slot] = 0;
+#ifdef __s88_frame_filter
+		frameFilter[slot] = frameHistory[slot] = 0;
+#endif
+	}
+
+	void clearAll() {
+		memset(this, 0, sizeof(*this));
+	}
+
+	unsigned int upDebounceTime(byte slot) const {
+		if (upDebounce[slot] == 0) {
+			return test(triggerSensor, slot) ? defaultTiming.triggerUpDebounce : defaultTiming.trackUpDebounce;
+		} else {
+			return upDebounce[slot];
+		}
+	}
+
+	unsigned int downDebounceTime(byte slot) const {
+		if (downDebounce[slot] == 0) {
+			return test(triggerSensor, slot) ? defaultTiming.triggerDownDebounce : defaultTiming.trackDownDebounce;
+		} else {
+			return downDebounce[slot];
+		}
+	}
+
+	void dumpTimeouts(byte slot) const;
+	void print(byte slot) const;
+};
+
+/**
+ * The flag bitsets must hold a bit for each slot.
+ */
+typedef char sensorTableFitsSlotMask[(maxSensorCount <= 8 * (int)sizeof(slotmask_t)) ? 1 : -1];
 
-	Sensor() : reportState(false), s88State(false), triggerChange(false), changing(false), changeProcessing(false), overriden(false),
-			triggerSensor(false), suspended(false), suspendedState(false) {}
-	Sensor(int id) : sensorId(id), reportState(false), s88State(false), triggerChange(false), changing(false), changeProcessing(false), overriden(false),
-			triggerSensor(false), suspended(false), suspendedState(false) {}
-	Sensor(const SensorData& data);
+extern SensorTable<maxSensorCount> sensors;
 
-	SensorData data() { return SensorData(*this); }
+void printSensors(boolean includeNone);
 
-	boolean isDefined() const { return sensorId != 0; }
-	static void printAll(boolean includeNone);
-	void print() const;
-	void clear() { sensorId = 0; }
+/**
+ * Returns the sensor table slot for the sensor ID, or -1 if the sensor is not defined.
+ */
+int findSensor(int id);
 
-	void dumpTimeouts() const;
+/**
+ * The states readS88() reports for all sensor slots at once: the debounced state, or the
+ * state saved by suspendS88() for suspended sensors.
+ */
+slotmask_t s88Snapshot();
 
-	int upDebounceTime() const;
-	int downDebounceTime() const;
-};
+/**
+ * Like s88Snapshot(), but while s88InLoop() delivers the queued events it reports the
+ * states as of the event being delivered: the states before the queued events, with the
+ * events up to the event's frame applied. Several edges of a sensor in one pass are thus
+ * each seen; sensors changed in one frame change at once.
+ */
+slotmask_t s88EventSnapshot();
 
-extern Sensor sensors[];
+/**
+ * Checks if the sensor's slot is in the set; false for an unknown sensor.
+ */
+inline boolean sensorInSet(slotmask_t set, int sensor) {
+	int slot = findSensor(sensor);
+	return slot >= 0 && (set & sensors.bit(slot)) != 0;
+}
+
+/**
+ * Reads the sensor from a snapshot taken by s88Snapshot(); false for an unknown sensor.
+ */
+inline boolean readS88(slotmask_t snapshot, int sensor) {
+	return sensorInSet(snapshot, sensor);
+}
+
+#ifdef __s88_frame_filter
+/**
+ * Makes the sensor report a change after 'votes' of the last 'window' frames; 0 votes
+ * restores the time debounce. Returns false for invalid values: a majority is required,
+ * so 2 * votes must exceed window.
+ */
+boolean setFrameFilter(byte slot, byte votes, byte window);
+#endif
+
+#ifdef __s88_calibration
+extern volatile boolean s88Calibrating;
+
+/**
+ * Feeds a raw bus edge of the sensor to the calibration; call only while s88Calibrating.
+ */
+void calibrationEdge(int sensorId, boolean state, unsigned long now);
+#endif
+
+/**
+ * Micros of the LOAD that completed the last processed frame. Sensor changes reported by
+ * sensorCallback come from this frame.
+ */
+unsigned long s88FrameMicros();
+
+/**
+ * Micros of the frame in which the bus state of the sensor last changed, 0 for an
+ * unknown sensor. Edge times of two sensors may be ordered by
+ * (long)(s88EdgeMicros(a) - s88EdgeMicros(b)), frames with equal timestamps are simultaneous.
+ */
+unsigned long s88EdgeMicros(int sensorId);
 
 #endif /* S88_H_ */
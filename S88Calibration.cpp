@@ -0,0 +1,165 @@
+/*
+ * S88Calibration.cpp
+ *
+ *  Created on: Apr 17, 2021
+ *      Author: sdedic
+ */
+
+#include <Arduino.h>
+#include "Defs.h"
+#include "S88.h"
+#include "Common.h"
+#include "Utils.h"
+
+#ifdef __s88_calibration
+
+/**
+ * Shortest debounce proposed, in frames; also the shortest noise limit.
+ */
+const int calibrationMinFrames = 3;
+
+volatile boolean s88Calibrating = false;
+
+/**
+ * Apply the proposed timeouts when the calibration ends.
+ */
+boolean calibrationApply = false;
+
+unsigned long calibrationStart;
+
+/**
+ * Micros of the last raw edge of each slot, 0 = no edge seen yet.
+ */
+unsigned long calibrationLastEdge[maxSensorCount];
+
+/**
+ * Longest noise pulse, in millis: spurious 1s on a free track (up) and dropouts
+ * of an occupied track (down).
+ */
+unsigned int calibrationUpNoise[maxSensorCount];
+unsigned int calibrationDownNoise[maxSensorCount];
+
+extern long millisQuantum;
+
+unsigned int calibrationQuantum() {
+	return millisQuantum > 0 ? millisQuantum : 1;
+}
+
+/**
+ * Pulses shorter than the sensor's current debounce for the pulse's state are the noise
+ * the debounce rejects; longer ones are real changes: a train, or a trigger sensor's
+ * short pulse. The limit is at least calibrationMinFrames frames.
+ */
+unsigned long calibrationNoiseLimit(byte slot, boolean pulseState) {
+	unsigned long limit = pulseState ? sensors.upDebounceTime(slot) : sensors.downDebounceTime(slot);
+	unsigned long minimum = (unsigned long)calibrationMinFrames * calibrationQuantum();
+	return limit > minimum ? limit : minimum;
+}
+
+void calibrationEdge(int sensorId, boolean state, unsigned long now) {
+	int slot = findSensor(sensorId);
+	if (slot < 0) {
+		return;
+	}
+	unsigned long last = calibrationLastEdge[slot];
+	// keep 0 for "no edge yet"
+	calibrationLastEdge[slot] = now | 1;
+	if (last == 0) {
+		return;
+	}
+	unsigned long width = (now - last) / 1000;
+	if (width >= calibrationNoiseLimit(slot, !state)) {
+		return;
+	}
+	// the edge ends a pulse of the opposite state
+	unsigned int* noise = state ? calibrationDownNoise : calibrationUpNoise;
+	if (width > noise[slot]) {
+		noise[slot] = width;
+	}
+}
+
+/**
+ * Shortest debounce that rejects the measured noise: the longest noise pulse with
+ * a 25% margin, plus a frame as the measurement is frame-granular; at least
+ * calibrationMinFrames frames.
+ */
+unsigned int proposeDebounce(unsigned int noise) {
+	unsigned int quantum = calibrationQuantum();
+	unsigned int debounce = noise + noise / 4 + quantum;
+	unsigned int minimum = calibrationMinFrames * quantum;
+	return debounce > minimum ? debounce : minimum;
+}
+
+void startCalibration(boolean apply) {
+	noInterrupts();
+	memset(calibrationLastEdge, 0, sizeof(calibrationLastEdge));
+	memset(calibrationUpNoise, 0, sizeof(calibrationUpNoise));
+	memset(calibrationDownNoise, 0, sizeof(calibrationDownNoise));
+	s88Calibrating = true;
+	interrupts();
+	calibrationApply = apply;
+	terminalCalibration = true;
+	calibrationStart = millis();
+	makeLedAck(&blinkCalibrateCont[0]);
+	Serial.print(F("Calibrating sensors for ")); Serial.print(calibrationTime / 1000); Serial.println(F(" sec"));
+}
+
+void finishCalibration() {
+	s88Calibrating = false;
+	terminalCalibration = false;
+	Serial.println(F("Calibration done, proposed timeouts:"));
+	for (int i = 0; i < maxSensorCount; i++) {
+		if (!sensors.isDefined(i)) {
+			continue;
+		}
+		if (calibrationLastEdge[i] == 0) {
+			Serial.print(F("# no edges on ")); Serial.println(sensors.sensorId[i]);
+			continue;
+		}
+		unsigned int up = proposeDebounce(calibrationUpNoise[i]);
+		unsigned int down = proposeDebounce(calibrationDownNoise[i]);
+		Serial.print(F("STM:")); Serial.print(sensors.sensorId[i]);
+		Serial.print(F(":U=")); Serial.print(up);
+		Serial.print(F(":D=")); Serial.print(down);
+		Serial.print(F("\t# noise up ")); Serial.print(calibrationUpNoise[i]);
+		Serial.print(F(", down ")); Serial.println(calibrationDownNoise[i]);
+		if (calibrationApply) {
+			sensors.upDebounce[i] = up;
+			sensors.downDebounce[i] = down;
+		}
+	}
+	if (calibrationApply) {
+		s88TimingChanged();
+		Serial.println(F("Applied; SAV to keep."));
+	}
+	makeLedAck(&blinkCalibrateEnd[0]);
+}
+
+/**
+ * CAL measures and prints the proposed timeouts, CAL:A applies them as well.
+ */
+void commandCalibrate() {
+	if (s88Calibrating) {
+		Serial.println(F("Calibration running."));
+		return;
+	}
+	startCalibration(*inputPos == 'A' || *inputPos == 'a');
+}
+
+boolean calibrationModuleHandler(ModuleCmd cmd) {
+	switch (cmd) {
+	case initialize:
+		registerLineCommand("CAL", &commandCalibrate);
+		break;
+	case periodic:
+		if (s88Calibrating && (millis() - calibrationStart) >= (unsigned long)calibrationTime) {
+			finishCalibration();
+		}
+		break;
+	}
+	return true;
+}
+
+ModuleChain calibrationModule("Calibrate", 2, &calibrationModuleHandler);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * S88Debounce.cpp
+ *
+ *  Created on: Apr 12, 2021
+ *      Author: sdedic
+ */
+
+#include <Arduino.h>
+#include "Defs.h"
+#include "S88.h"
+
+#ifdef __s88_vertical_debounce
+
+/**
+ * Vertical counters: bit 'k' of the counter of bus bit 'b' is stored at plane 'k', at the
+ * bit 'b' position. A counter counts the frames in which the bus bit differs from its
+ * debounced state and resets when they agree again. All counters of a lane are incremented
+ * by a single ripple-carry pass over the planes.
+ */
+s88lane_t s88DebounceCount[s88DebouncePlanes][s88Lanes];
+
+/**
+ * Frame thresholds, in the same vertical layout, for bits going up / down.
+ */
+s88lane_t s88DebounceUp[s88DebouncePlanes][s88Lanes];
+s88lane_t s88DebounceDown[s88DebouncePlanes][s88Lanes];
+
+s88lane_t s88DebouncedState[s88Lanes];
+
+const int s88LaneBits = 8 * sizeof(s88lane_t);
+
+/**
+ * Number of frames covering the debounce time. If the frame period alone exceeds it,
+ * the first differing frame reports the change, as the timed debounce does.
+ */
+int debounceFrames(int millis, long quantum) {
+	if (quantum <= 0 || quantum > millis) {
+		return 1;
+	}
+	long frames = millis / quantum + 1;
+	return frames > s88DebounceMaxFrames ? s88DebounceMaxFrames : frames;
+}
+
+void storeThreshold(s88lane_t (*planes)[s88Lanes], int lane, s88lane_t mask, int frames) {
+	for (int k = 0; k < s88DebouncePlanes; k++) {
+		if (frames & (1 << k)) {
+			planes[k][lane] |= mask;
+		} else {
+			planes[k][lane] &= ~mask;
+		}
+	}
+}
+
+void verticalDebounceThresholds(long quantum) {
+	// undefined bits just follow the bus
+	for (int l = 0; l < s88Lanes; l++) {
+		for (int k = 0; k < s88DebouncePlanes; k++) {
+			s88DebounceUp[k][l] = s88DebounceDown[k][l] = (k == 0) ? (s88lane_t)~0 : 0;
+		}
+	}
+	for (int i = 0; i < maxSensorCount; i++) {
+		if (!sensors.isDefined(i)) {
+			continue;
+		}
+		int bit = sensors.sensorId[i] - 1;
+		int lane = bit / s88LaneBits;
+		s88lane_t mask = ((s88lane_t)1) << (bit % s88LaneBits);
+		storeThreshold(s88DebounceUp, lane, mask, debounceFrames(sensors.upDebounceTime(i), quantum));
+		storeThreshold(s88DebounceDown, lane, mask, debounceFrames(sensors.downDebounceTime(i), quantum));
+	}
+}
+
+boolean verticalDebounce(const s88lane_t* raw, s88lane_t* flipped, byte lanes) {
+	s88lane_t pending = 0;
+	for (int l = 0; l < lanes; l++) {
+		s88lane_t r = raw[l];
+		s88lane_t diff = r ^ s88DebouncedState[l];
+
+		// increment the counters of differing bits, reset the others
+		s88lane_t carry = diff;
+		for (int k = 0; k < s88DebouncePlanes; k++) {
+			s88lane_t c = s88DebounceCount[k][l];
+			s88DebounceCount[k][l] = (c ^ carry) & diff;
+			carry &= c;
+		}
+		if (carry) {
+			// saturate at the max frame count
+			for (int k = 0; k < s88DebouncePlanes; k++) {
+				s88DebounceCount[k][l] |= carry;
+			}
+		}
+
+		// the bits whose counter reached the threshold for the direction they move to. The
+		// thresholds change with the frame period, so a counter may already be past a lowered one:
+		// compare magnitudes from the top plane down.
+		s88lane_t greater = 0;
+		s88lane_t equal = diff;
+		for (int k = s88DebouncePlanes - 1; k >= 0; k--) {
+			s88lane_t c = s88DebounceCount[k][l];
+			s88lane_t threshold = (r & s88DebounceUp[k][l]) | (~r & s88DebounceDown[k][l]);
+			greater |= equal & c & ~threshold;
+			equal &= ~(c ^ threshold);
+		}
+		s88lane_t reached = diff & (greater | equal);
+		if (reached) {
+			s88DebouncedState[l] ^= reached;
+			for (int k = 0; k < s88DebouncePlanes; k++) {
+				s88DebounceCount[k][l] &= ~reached;
+			}
+		}
+		flipped[l] = reached;
+		pending |= diff & ~reached;
+	}
+	return pending != 0;
+}
+
+#endif
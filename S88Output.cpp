@@ -0,0 +1,89 @@
+/*
+ * S88Output.cpp
+ *
+ *  Created on: Apr 19, 2021
+ *      Author: sdedic
+ */
+
+#include <Arduino.h>
+#include "Common.h"
+#include "S88Output.h"
+
+#ifdef __s88_virtual_output
+
+volatile byte s88VirtualOut[s88VirtualBytes];
+
+/**
+ * Refreshes the virtual module bytes from the loops and relays. Each byte is a single
+ * store, so a frame never carries a half-updated loop.
+ */
+void s88VirtualUpdate() {
+	for (int i = 0; i < maxLoopCount; i++) {
+		const LoopState& s = loopStates[i];
+		byte b = 0;
+		if (loopDefinitions[i].active) {
+			b = s88VirtualDefined | (s.status & 0x0f);
+			if (s.direction == left) {
+				b |= s88VirtualDirection;
+			}
+			if (s.outage()) {
+				b |= s88VirtualOutage;
+			}
+		}
+		s88VirtualOut[i] = b;
+	}
+	byte relays = 0;
+	for (int r = 1; r <= maxRelayCount; r++) {
+		if (isRelayOn(r)) {
+			relays |= 1 << (r - 1);
+		}
+	}
+	s88VirtualOut[maxLoopCount] = relays;
+}
+
+void s88VirtualStatus() {
+	if (s88Config.physicalModules == 0) {
+		Serial.println(F("S88 virtual output: off"));
+		return;
+	}
+	Serial.print(F("S88 virtual output: modules ")); Serial.print(s88Config.physicalModules + 1);
+	Serial.print('-'); Serial.print(s88Config.physicalModules + s88VirtualBytes);
+	Serial.print(F(", sensors ")); Serial.print(s88Config.physicalModules * 8 + 1);
+	Serial.print('-'); Serial.println((s88Config.physicalModules + s88VirtualBytes) * 8);
+}
+
+/**
+ * SVO:n appends the virtual modules after n physical ones; SVO:0 turns the output off.
+ * The command station must read the additional modules.
+ */
+void cmdVirtualOutput() {
+	int n = nextNumber();
+	if (n < 0 || n > s88MaxSize) {
+		Serial.println(F("Invalid module count."));
+		return;
+	}
+	noInterrupts();
+	s88Config.physicalModules = n;
+	interrupts();
+	s88VirtualStatus();
+}
+
+boolean s88OutputModuleHandler(ModuleCmd cmd) {
+	switch (cmd) {
+	case initialize:
+		registerLineCommand("SVO", &cmdVirtualOutput);
+		break;
+	case periodic:
+		s88VirtualUpdate();
+		break;
+	case status:
+		s88VirtualStatus();
+		break;
+	}
+	return true;
+}
+
+// after the loops, so the published state is the one of this pass
+ModuleChain s88OutputModule("S88Out", 4, &s88OutputModuleHandler);
+
+#endif
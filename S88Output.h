@@ -0,0 +1,51 @@
+/*
+ * S88Output.h
+ *
+ *  Created on: Apr 19, 2021
+ *      Author: sdedic
+ */
+
+#ifndef S88OUTPUT_H_
+#define S88OUTPUT_H_
+
+#include <Arduino.h>
+#include "S88.h"
+#include "Loops.h"
+
+#ifdef __s88_virtual_output
+/**
+ * Virtual module bytes: one per loop, then one with the relays.
+ *
+ * Loop byte: bits 0-3 = Status, bit 4 = Direction (1 = left), bit 5 = power outage,
+ * bit 6 = loop defined. Relay byte: bit 'r - 1' = relay 'r' is on.
+ */
+const byte s88VirtualBytes = maxLoopCount + 1;
+
+const byte s88VirtualDirection = 0x10;
+const byte s88VirtualOutage = 0x20;
+const byte s88VirtualDefined = 0x40;
+
+/**
+ * Data shifted out after the physical chain; the first bit sent is bit 0 of the first byte.
+ * Written by the main loop, read by the CLOCK interrupt.
+ */
+extern volatile byte s88VirtualOut[s88VirtualBytes];
+
+/**
+ * The bus bit to send for the clock 'clock' (0-based) of the frame: the virtual data
+ * after the physical chain, otherwise the bit read from DATA_IN.
+ */
+inline boolean s88OutputBit(int clock, boolean in) {
+	int first = s88Config.physicalModules * 8;
+	if (first == 0 || clock < first) {
+		return in;
+	}
+	clock -= first;
+	if (clock >= s88VirtualBytes * 8) {
+		return false;
+	}
+	return (s88VirtualOut[clock / 8] >> (clock % 8)) & 1;
+}
+#endif
+
+#endif /* S88OUTPUT_H_ */
@@ -0,0 +1,228 @@
+/*
+ * S88Stats.cpp
+ *
+ *  Created on: Apr 14, 2021
+ *      Author: sdedic
+ */
+
+#include <Arduino.h>
+#include "Common.h"
+#include "S88Stats.h"
+
+/**
+ * Written by the LOAD interrupt only; the main loop reads it with interrupts disabled.
+ */
+volatile S88Timing s88Timing;
+
+/**
+ * micros() of the previous LOAD, 0 before the first one.
+ */
+unsigned long s88LastLoadMicros = 0;
+
+void s88TimingReset() {
+	noInterrupts();
+	memset((void*)&s88Timing, 0, sizeof(s88Timing));
+	s88Timing.periodMin = 0xffffffff;
+	s88Timing.clocksMin = 0x7fff;
+	s88LastLoadMicros = 0;
+	interrupts();
+}
+
+byte histogramBin(unsigned long period) {
+	unsigned long limit = s88HistogramBase;
+	byte bin = 0;
+	while (period >= limit && bin < s88HistogramBins - 1) {
+		limit <<= 1;
+		bin++;
+	}
+	return bin;
+}
+
+void s88TimingLoad(unsigned long now, int clocks) {
+	volatile S88Timing& t = s88Timing;
+	t.frames++;
+	t.clocksLast = clocks;
+	if (clocks < t.clocksMin) {
+		t.clocksMin = clocks;
+	}
+	if (clocks > t.clocksMax) {
+		t.clocksMax = clocks;
+	}
+	unsigned long prev = s88LastLoadMicros;
+	s88LastLoadMicros = now;
+	if (prev == 0) {
+		return;
+	}
+	// unsigned difference survives the micros() overflow
+	unsigned long period = now - prev;
+	t.periodLast = period;
+	if (period < t.periodMin) {
+		t.periodMin = period;
+	}
+	if (period > t.periodMax) {
+		t.periodMax = period;
+	}
+	if (t.periodCount >= s88AverageWindow) {
+		t.periodSum >>= 1;
+		t.periodCount >>= 1;
+	}
+	t.periodSum += period;
+	t.periodCount++;
+	t.histogram[histogramBin(period)]++;
+}
+
+unsigned long s88TimingAverageIsr() {
+	return s88Timing.periodCount > 0 ? s88Timing.periodSum / s88Timing.periodCount : 0;
+}
+
+void s88TimingSnapshot(S88Timing& out) {
+	noInterrupts();
+	memcpy(&out, (const void*)&s88Timing, sizeof(out));
+	interrupts();
+}
+
+void s88TimingPrint() {
+	S88Timing t;
+	s88TimingSnapshot(t);
+	Serial.print(F("S88 frames: ")); Serial.println(t.frames);
+	if (t.periodCount == 0) {
+		Serial.println(F("S88 period: unknown"));
+		return;
+	}
+	Serial.print(F("S88 period (us): avg=")); Serial.print(t.average());
+	Serial.print(F(" min=")); Serial.print(t.periodMin);
+	Serial.print(F(" max=")); Serial.print(t.periodMax);
+	Serial.print(F(" last=")); Serial.println(t.periodLast);
+	Serial.print(F("S88 clocks: min=")); Serial.print(t.clocksMin);
+	Serial.print(F(" max=")); Serial.print(t.clocksMax);
+	Serial.print(F(" last=")); Serial.println(t.clocksLast);
+	unsigned long limit = s88HistogramBase;
+	for (byte i = 0; i < s88HistogramBins; i++) {
+		if (i < s88HistogramBins - 1) {
+			Serial.print(F("  <")); Serial.print(limit / 1000);
+		} else {
+			Serial.print(F(" >=")); Serial.print(limit / 2000);
+		}
+		Serial.print(F("ms\t")); Serial.println(t.histogram[i]);
+		limit <<= 1;
+	}
+}
+
+/**
+ * S8T prints the timing statistics, S8T:R prints and resets them.
+ */
+void cmdS88Timing() {
+	s88TimingPrint();
+	if (*inputPos == 'R' || *inputPos == 'r') {
+		s88TimingReset();
+		Serial.println(F("Statistics reset."));
+	}
+}
+
+#ifdef __s88_sensor_stats
+/**
+ * Updated by the debounce, so in the per-bit mode by the CLOCK interrupt.
+ */
+SensorStats sensorStats[maxSensorCount];
+
+void sensorStatsClear(byte slot) {
+	memset(&sensorStats[slot], 0, sizeof(SensorStats));
+}
+
+void sensorStatsReset() {
+	memset(sensorStats, 0, sizeof(sensorStats));
+}
+
+inline void statsCount(unsigned int& counter) {
+	if (counter < 0xffff) {
+		counter++;
+	}
+}
+
+void sensorStatsEdge(byte slot, boolean state, boolean reportState, unsigned long now) {
+	SensorStats& st = sensorStats[slot];
+	statsCount(st.rawEdges);
+	if (state == reportState) {
+		// back to the reported state: the debounce did not accept the previous edge
+		statsCount(st.glitches);
+	}
+	if (st.lastEdge != 0) {
+		unsigned long stable = (now - st.lastEdge) / 1000;
+		if (stable > st.longestStable) {
+			st.longestStable = stable;
+		}
+	}
+	st.lastEdge = now | 1;
+}
+
+void sensorStatsChange(byte slot, boolean state, unsigned long now) {
+	SensorStats& st = sensorStats[slot];
+	statsCount(st.debouncedEdges);
+	if (state) {
+		st.occupiedFrom = now | 1;
+	} else if (st.occupiedFrom != 0) {
+		st.occupiedMillis += (now - st.occupiedFrom) / 1000;
+		st.occupiedFrom = 0;
+	}
+}
+
+/**
+ * SST prints the statistics of the defined sensors, SST:R prints and resets them.
+ * Occupied and stable times include the current occupancy / stable period.
+ */
+void cmdSensorStats() {
+	Serial.println(F("Sensor\traw\tdeb\tglitch\tocc(ms)\tstable(ms)"));
+	for (int i = 0; i < maxSensorCount; i++) {
+		if (!sensors.isDefined(i)) {
+			continue;
+		}
+		unsigned long now = s88FrameMicros();
+		SensorStats st;
+		noInterrupts();
+		st = sensorStats[i];
+		interrupts();
+		// the interrupt may have stamped a newer frame meanwhile
+		unsigned long occupied = st.occupiedMillis;
+		if (st.occupiedFrom != 0 && (long)(now - st.occupiedFrom) > 0) {
+			occupied += (now - st.occupiedFrom) / 1000;
+		}
+		unsigned long stable = st.longestStable;
+		if (st.lastEdge != 0 && (long)(now - st.lastEdge) > 0 && (now - st.lastEdge) / 1000 > stable) {
+			stable = (now - st.lastEdge) / 1000;
+		}
+		Serial.print(sensors.sensorId[i]);
+		Serial.print('\t'); Serial.print(st.rawEdges);
+		Serial.print('\t'); Serial.print(st.debouncedEdges);
+		Serial.print('\t'); Serial.print(st.glitches);
+		Serial.print('\t'); Serial.print(occupied);
+		Serial.print('\t'); Serial.println(stable);
+	}
+	if (*inputPos == 'R' || *inputPos == 'r') {
+		noInterrupts();
+		sensorStatsReset();
+		interrupts();
+		Serial.println(F("Statistics reset."));
+	}
+}
+#endif
+
+boolean s88StatsModuleHandler(ModuleCmd cmd) {
+	switch (cmd) {
+	case initialize:
+		s88TimingReset();
+		registerLineCommand("S8T", &cmdS88Timing);
+#ifdef __s88_sensor_stats
+		registerLineCommand("SST", &cmdSensorStats);
+#endif
+		break;
+	case status: {
+		S88Timing t;
+		s88TimingSnapshot(t);
+		Serial.print(F("S88 period (us): ")); Serial.println(t.average());
+		break;
+	}
+	}
+	return true;
+}
+
+ModuleChain s88StatsModule("S88Stats", 2, &s88StatsModuleHandler);
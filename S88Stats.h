@@ -0,0 +1,125 @@
+/*
+ * S88Stats.h
+ *
+ *  Created on: Apr 14, 2021
+ *      Author: sdedic
+ */
+
+#ifndef S88STATS_H_
+#define S88STATS_H_
+
+#include <Arduino.h>
+#include "S88.h"
+
+/**
+ * Number of LOAD period histogram bins. Bin 0 counts periods below s88HistogramBase,
+ * each following bin doubles the limit, the last bin takes everything above.
+ */
+const byte s88HistogramBins = 8;
+const unsigned long s88HistogramBase = 5000;	// micros
+
+/**
+ * Number of periods after which the average is halved, so it follows drifts of the timing.
+ */
+const unsigned int s88AverageWindow = 1024;
+
+struct S88Timing {
+	/**
+	 * LOAD period, in micros.
+	 */
+	unsigned long periodMin;
+	unsigned long periodMax;
+	unsigned long periodLast;
+	unsigned long periodSum;
+	unsigned int periodCount;
+
+	/**
+	 * Clock edges between two LOADs.
+	 */
+	int clocksMin;
+	int clocksMax;
+	int clocksLast;
+
+	unsigned long frames;
+	unsigned int histogram[s88HistogramBins];
+
+	unsigned long average() const {
+		return periodCount > 0 ? periodSum / periodCount : 0;
+	}
+};
+
+/**
+ * Records a LOAD at 'now' (micros), after 'clocks' clock edges. Called from the LOAD interrupt.
+ */
+void s88TimingLoad(unsigned long now, int clocks);
+
+/**
+ * Average LOAD period in micros, 0 if not known yet. Interrupt context only.
+ */
+unsigned long s88TimingAverageIsr();
+
+/**
+ * Consistent copy of the statistics, for the main loop.
+ */
+void s88TimingSnapshot(S88Timing& out);
+
+void s88TimingReset();
+void s88TimingPrint();
+
+#ifdef __s88_sensor_stats
+/**
+ * Activity of a sensor, kept by the debounce. Counters stop at their max value.
+ * Times are measured on the micros() frame timestamps, so a single period longer than
+ * the micros() wrap (~70 minutes) is not measured correctly.
+ */
+struct SensorStats {
+	/**
+	 * Changes of the bus state.
+	 */
+	unsigned int rawEdges;
+
+	/**
+	 * Changes reported after the debounce.
+	 */
+	unsigned int debouncedEdges;
+
+	/**
+	 * Bus changes which returned to the reported state before the debounce accepted them.
+	 */
+	unsigned int glitches;
+
+	/**
+	 * Total millis the sensor was reported occupied, not counting the current occupancy.
+	 */
+	unsigned long occupiedMillis;
+
+	/**
+	 * Longest millis the bus state held between two edges.
+	 */
+	unsigned long longestStable;
+
+	/**
+	 * Micros of the frame that reported the sensor occupied, and of the last bus edge;
+	 * 0 = none. The low bit is always set in a valid time.
+	 */
+	unsigned long occupiedFrom;
+	unsigned long lastEdge;
+};
+
+extern SensorStats sensorStats[];
+
+void sensorStatsClear(byte slot);
+void sensorStatsReset();
+
+/**
+ * Records a bus edge of the sensor to 'state', before the debounce processes it.
+ */
+void sensorStatsEdge(byte slot, boolean state, boolean reportState, unsigned long now);
+
+/**
+ * Records a reported change of the sensor to 'state'.
+ */
+void sensorStatsChange(byte slot, boolean state, unsigned long now);
+#endif
+
+#endif /* S88STATS_H_ */
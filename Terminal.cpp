@@ -15,6 +15,11 @@ const boolean debugInfra = false;
 
 const int MAX_LINE = 60;
 boolean interactive = true;
+
+/**
+ * The CAL command is collecting sensor edges.
+ */
+boolean terminalCalibration = false;
 void (* charModeCallback)(char) = NULL;
 const int maxLineCommands = 40;
 
@@ -9,17 +9,17 @@
 #include "../Defs.h"
 #include "../S88.h"
 
-extern long lastS88Millis;
+extern unsigned long lastS88Micros;
 
-void storeS88Bit(int sensorId, int state);
+void storeS88Bit(int sensorId, int state, boolean skipOverride);
 
-void s88Callback(int sensor, boolean state) {
+void s88Callback(const SensorEvent& e) {
 	Serial.println("");
-	Serial.print(F("---> sensor ")); Serial.print(sensor); Serial.print(F(" changed to ")); Serial.println(state);
+	Serial.print(F("---> sensor ")); Serial.print(e.sensorId); Serial.print(F(" changed to ")); Serial.println(e.state);
 }
 
 void s88Load(const char* hexString) {
-	lastS88Millis = millis();
+	lastS88Micros = micros();
 	int sensor = 1;
 	const char* ptr = hexString;
 	while (*ptr) {
@@ -38,7 +38,7 @@ void s88Load(const char* hexString) {
 			continue;
 		}
 		for (int i = 0; i < 4; i++) {
-			storeS88Bit(sensor++, (c & 0x01) > 0 ? 1 : 0);
+			storeS88Bit(sensor++, (c & 0x01) > 0 ? 1 : 0, true);
 			c >>= 1;
 		}
 		ptr--;
@@ -49,37 +49,227 @@ void s88Load(const char* hexString) {
 void testS88() {
 	sensorCallback = &s88Callback;
 	// initial state
-	Sensor::printAll(true);
+	printSensors(true);
 
 	// define 3 sensors. One active (5), one dormant (3), one will be flipping
 	defineSensor(1);
 	defineSensor(3);
 	defineSensor(5);
 	Serial.println(F("Sensors defined"));
-	Sensor::printAll(true);
+	printSensors(true);
 
 	s88Load("11");
 	Serial.println(F("Sensors loaded"));
-	Sensor::printAll(false);
+	printSensors(false);
 
 	// sensor #1 flips back to 0
 	s88Load("10");
-	Sensor::printAll(false);
+	printSensors(false);
 
 	// and again to 1
 	s88Load("11");
-	Sensor::printAll(false);
+	printSensors(false);
 
 	delay(100);
 	s88Load("10");
 	delay(100);
 	s88Load("11");
 	Serial.println(F("Sensors updated"));
-	Sensor::printAll(false);
+	printSensors(false);
 
 	delay(200);
 	s88Load("11");
 	Serial.println(F("All flipped"));
-	Sensor::printAll(false);
+	printSensors(false);
 }
 
+
+#ifdef __test_s88_debounce
+#include "../Common.h"
+#include "../Debug.h"
+
+extern long millisQuantum;
+
+void debounceSensor(byte i, int state, boolean skipOverride, unsigned long now);
+
+/**
+ * A sensor with different up and down timeouts must use each of them for its own edge.
+ */
+void testSeparateTimeouts() {
+	defineSensor(1);
+	int slot = findSensor(1);
+	sensors.upDebounce[slot] = 200;
+	sensors.downDebounce[slot] = 600;
+	assert(F("up timeout"), sensors.upDebounceTime(slot) == 200);
+	assert(F("down timeout"), sensors.downDebounceTime(slot) == 600);
+
+	unsigned long t = 1000000;
+	debounceSensor(slot, 1, false, t);
+	debounceSensor(slot, 1, false, t + 150000);
+	assert(F("up before the up timeout"), !sensors.test(sensors.reportState, slot));
+	debounceSensor(slot, 1, false, t + 250000);
+	assert(F("up after the up timeout"), sensors.test(sensors.reportState, slot));
+
+	t += 1000000;
+	debounceSensor(slot, 0, false, t);
+	debounceSensor(slot, 0, false, t + 300000);
+	assert(F("down before the down timeout"), sensors.test(sensors.reportState, slot));
+	debounceSensor(slot, 0, false, t + 700000);
+	assert(F("down after the down timeout"), !sensors.test(sensors.reportState, slot));
+
+#ifdef __s88_vertical_debounce
+	// 3 frames up, 7 frames down at 10ms
+	s88lane_t raw[s88Lanes] = { 0 };
+	s88lane_t flipped[s88Lanes];
+	sensors.upDebounce[slot] = 20;
+	sensors.downDebounce[slot] = 60;
+	verticalDebounceThresholds(10);
+	raw[0] = 0x01;
+	for (int i = 0; i < 3; i++) {
+		verticalDebounce(raw, flipped, s88Lanes);
+	}
+	assert(F("vertical up"), (s88DebouncedState[0] & 0x01) != 0);
+	raw[0] = 0;
+	for (int i = 0; i < 6; i++) {
+		verticalDebounce(raw, flipped, s88Lanes);
+	}
+	assert(F("vertical down before the down timeout"), (s88DebouncedState[0] & 0x01) != 0);
+	verticalDebounce(raw, flipped, s88Lanes);
+	assert(F("vertical down after the down timeout"), (s88DebouncedState[0] & 0x01) == 0);
+#endif
+
+	sensors.upDebounce[slot] = sensors.downDebounce[slot] = 0;
+	freeSensor(1);
+#ifdef __s88_vertical_debounce
+	verticalDebounceThresholds(millisQuantum);
+#endif
+}
+
+/**
+ * Sensor 1 and 2 states seen by the callback for each delivered event.
+ */
+byte eventSnapshots[4];
+byte eventSnapshotCount;
+
+void recordEventSnapshot(const SensorEvent& e) {
+	if (eventSnapshotCount < 4) {
+		eventSnapshots[eventSnapshotCount++] = (readS88(s88EventSnapshot(), 1) ? 1 : 0) | (readS88(s88EventSnapshot(), 2) ? 2 : 0);
+	}
+}
+
+/**
+ * Edges queued in one pass are each seen with the bus state as of the edge, not the final one.
+ */
+void testEventSnapshot() {
+	defineSensor(1);
+	defineSensor(2);
+	sensorChangeFunc saved = sensorCallback;
+	sensorCallback = &recordEventSnapshot;
+	eventSnapshotCount = 0;
+
+	overrideS88(1, true, true);
+	overrideS88(2, true, true);
+	overrideS88(1, true, false);
+	s88InLoop();
+	assert(F("three events"), eventSnapshotCount == 3);
+	assert(F("sensor 1 up"), eventSnapshots[0] == 1);
+	assert(F("sensor 2 up"), eventSnapshots[1] == 3);
+	assert(F("sensor 1 down"), eventSnapshots[2] == 2);
+
+	overrideS88(1, false, false);
+	overrideS88(2, false, false);
+	s88InLoop();
+	sensorCallback = saved;
+	freeSensor(1);
+	freeSensor(2);
+}
+
+#ifdef __s88_calibration
+extern unsigned long calibrationLastEdge[];
+extern unsigned int calibrationUpNoise[];
+extern unsigned int calibrationDownNoise[];
+
+void startCalibration(boolean apply);
+void finishCalibration();
+unsigned int proposeDebounce(unsigned int noise);
+
+/**
+ * CAL:A must apply both proposed timeouts, and the debounce must use them.
+ */
+void testCalibrationApply() {
+	defineSensor(1);
+	int slot = findSensor(1);
+	startCalibration(true);
+	calibrationLastEdge[slot] = 1;
+	calibrationUpNoise[slot] = 40;
+	calibrationDownNoise[slot] = 400;
+	finishCalibration();
+	unsigned int up = proposeDebounce(40);
+	unsigned int down = proposeDebounce(400);
+	assert(F("proposals differ"), up != down);
+	assert(F("applied up timeout"), sensors.upDebounceTime(slot) == up);
+	assert(F("applied down timeout"), sensors.downDebounceTime(slot) == down);
+
+	sensors.upDebounce[slot] = sensors.downDebounce[slot] = 0;
+	freeSensor(1);
+}
+#endif
+
+#ifdef __s88_vertical_debounce
+
+/**
+ * The frame thresholds follow the measured frame period. A bit which is settling when
+ * the period grows must still flip, although its counter is already past the new threshold.
+ */
+void testLoweredThreshold() {
+	defineSensor(1);
+	int slot = findSensor(1);
+	sensors.upDebounce[slot] = sensors.downDebounce[slot] = 100;
+
+	s88lane_t raw[s88Lanes] = { 0 };
+	s88lane_t flipped[s88Lanes];
+
+	// 11 frames needed at 10ms, the bit sees 8 of them
+	verticalDebounceThresholds(10);
+	raw[0] = 0x01;
+	for (int i = 0; i < 8; i++) {
+		verticalDebounce(raw, flipped, s88Lanes);
+		assert(F("settling"), (flipped[0] & 0x01) == 0);
+	}
+
+	// 3 frames needed at 50ms; the counter is already at 8
+	verticalDebounceThresholds(50);
+	verticalDebounce(raw, flipped, s88Lanes);
+	assert(F("flipped after the threshold dropped"), (flipped[0] & 0x01) != 0);
+	assert(F("debounced up"), (s88DebouncedState[0] & 0x01) != 0);
+
+	raw[0] = 0;
+	for (int i = 0; i < 3; i++) {
+		verticalDebounce(raw, flipped, s88Lanes);
+	}
+	assert(F("debounced down"), (s88DebouncedState[0] & 0x01) == 0);
+
+	sensors.upDebounce[slot] = sensors.downDebounce[slot] = 0;
+	freeSensor(1);
+	verticalDebounceThresholds(millisQuantum);
+}
+
+#endif
+
+boolean s88DebounceTest(ModuleCmd cmd) {
+	if (cmd != test) {
+		return false;
+	}
+	testEventSnapshot();
+	testSeparateTimeouts();
+#ifdef __s88_calibration
+	testCalibrationApply();
+#endif
+#ifdef __s88_vertical_debounce
+	testLoweredThreshold();
+#endif
+	return true;
+}
+
+ModuleChain s88DebounceTestModule("s88DebounceTest", 99, &s88DebounceTest);
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Trace.cpp
+ *
+ *  Created on: Apr 15, 2021
+ *      Author: sdedic
+ */
+
+#include <Arduino.h>
+#include "Common.h"
+#include "Debug.h"
+#include "Trace.h"
+
+TraceRecord traceRing[traceRingSize];
+volatile byte traceHead = 0;
+volatile byte traceTail = 0;
+volatile unsigned int traceOverflows = 0;
+
+byte traceMask = (debugS88Debounce ? traceDebounce : 0) | (debugS88Low ? traceBus : 0);
+
+/**
+ * Max records printed in one pass of the main loop, so the serial output does not
+ * delay the loop too much.
+ */
+const byte traceDrainCount = 4;
+
+unsigned int traceReportedOverflows = 0;
+
+void tracePrint(const TraceRecord& r) {
+	switch (r.kind) {
+		case traceChanging:
+			Serial.print(F("Sensor ")); Serial.print(r.id); Serial.print(F(" changing to "));
+			Serial.print(r.value); Serial.print(F(" at millis ")); Serial.println(r.time);
+			break;
+		case traceReset:
+			Serial.print(F("Sensor ")); Serial.print(r.id); Serial.print(F(" reset after ")); Serial.println(r.time);
+			break;
+		case traceSteady:
+			Serial.print(F("Sensor ")); Serial.print(r.id); Serial.print(F(" steady: ")); Serial.println(r.time);
+			break;
+		case traceTrigger:
+			Serial.print(F("Sensor ")); Serial.print(r.id); Serial.print(F(" TRIGGER to ")); Serial.print(r.value);
+			Serial.print(F(" after ")); Serial.println(r.time);
+			break;
+		case traceByte:
+			Serial.print(F("S88 read byte: ")); Serial.print(r.id + 1); Serial.print(F(" = "));
+			Serial.println(r.value);
+			break;
+	}
+}
+
+void traceDrain() {
+	for (byte i = 0; i < traceDrainCount; i++) {
+		byte tail = traceTail;
+		if (tail == traceHead) {
+			break;
+		}
+		TraceRecord r = traceRing[tail];
+		traceTail = (tail + 1) & (traceRingSize - 1);
+		tracePrint(r);
+	}
+	noInterrupts();
+	unsigned int o = traceOverflows;
+	interrupts();
+	if (o != traceReportedOverflows) {
+		Serial.print(F("Trace records lost: ")); Serial.println(o - traceReportedOverflows);
+		traceReportedOverflows = o;
+	}
+}
+
+/**
+ * TRC prints the trace mask, TRC:n sets it: 1 = debounce, 2 = bus bytes.
+ */
+void commandTrace() {
+	int n = nextNumber();
+	if (n >= 0) {
+		traceMask = n;
+	}
+	noInterrupts();
+	unsigned int o = traceOverflows;
+	interrupts();
+	Serial.print(F("Trace mask: ")); Serial.print(traceMask);
+	Serial.print(F(", lost: ")); Serial.println(o);
+}
+
+boolean traceModuleHandler(ModuleCmd cmd) {
+	switch (cmd) {
+	case initialize:
+		registerLineCommand("TRC", &commandTrace);
+		break;
+	case periodic:
+		traceDrain();
+		break;
+	}
+	return true;
+}
+
+ModuleChain traceModule("Trace", 90, &traceModuleHandler);
@@ -0,0 +1,84 @@
+/*
+ * Trace.h
+ *
+ *  Created on: Apr 15, 2021
+ *      Author: sdedic
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <Arduino.h>
+
+/**
+ * Trace categories, bits of traceMask.
+ */
+const byte traceDebounce = 0x01;
+const byte traceBus = 0x02;
+
+enum TraceKind {
+	/**
+	 * Sensor started changing to 'value'; 'time' = millis.
+	 */
+	traceChanging,
+	/**
+	 * Sensor returned to its reported state; 'time' = elapsed millis.
+	 */
+	traceReset,
+	/**
+	 * Sensor still debounces; 'time' = elapsed millis.
+	 */
+	traceSteady,
+	/**
+	 * Sensor reported 'value'; 'time' = elapsed millis.
+	 */
+	traceTrigger,
+	/**
+	 * Bus byte 'id' (0-based) read as 'value'.
+	 */
+	traceByte
+};
+
+struct TraceRecord {
+	byte kind;
+	/**
+	 * Sensor ID, up to maxSensorId; or the bus byte index.
+	 */
+	byte id;
+	byte value;
+	unsigned int time;
+};
+
+/**
+ * Ring capacity, must be a power of 2.
+ */
+const byte traceRingSize = 16;
+
+extern TraceRecord traceRing[traceRingSize];
+extern volatile byte traceHead;
+extern volatile byte traceTail;
+extern volatile unsigned int traceOverflows;
+extern byte traceMask;
+
+/**
+ * Appends a record to the trace ring. Cheap enough for interrupt context: there's
+ * exactly one producer, the S88 processing (the interrupt or the main loop, depending
+ * on the build), and the main loop drains the ring. A full ring drops the record and
+ * counts it in traceOverflows.
+ */
+inline void trace(byte kind, byte id, byte value, unsigned int time) {
+	byte head = traceHead;
+	byte next = (head + 1) & (traceRingSize - 1);
+	if (next == traceTail) {
+		traceOverflows++;
+		return;
+	}
+	TraceRecord& r = traceRing[head];
+	r.kind = kind;
+	r.id = id;
+	r.value = value;
+	r.time = time;
+	traceHead = next;
+}
+
+#endif /* TRACE_H_ */
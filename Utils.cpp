@@ -9,6 +9,7 @@
 #include <EEPROM.h>
 #include "Defs.h"
 #include "Utils.h"
+#include "FastIO.h"
 
 // ========================= ModuleChain ================================
 
@@ -192,6 +193,12 @@ void resetEEPROM() {
 	makeLedAck(&blinkReset[0]);
 }
 
+/**
+ * LED sequences of the CAL command: calibration running, finished.
+ */
+const int blinkCalibrateCont[] = { 50, 200, 50, 200, 50, 0 };
+const int blinkCalibrateEnd[] = { 1000, 0 };
+
 const int* blinkPtr = NULL;
 long blinkLastMillis;
 byte pos = 0;
@@ -205,7 +212,7 @@ void makeLedAck(const int *  ledSequence) {
     ackLedState = 1;
     blinkLastMillis = millis();
     lastLedSignalled = blinkLastMillis;
-    digitalWrite(LED_ACK, HIGH);
+    FastPin<LED_ACK>::high();
     if (debugLed) {
       Serial.print(F("LED ACK start: ")); Serial.println(blinkPtr[pos]);
     }
@@ -232,7 +239,7 @@ void handleAckLed() {
   }
   if (blinkPtr[pos] == 0) {
     ackLedState = 0;
-    digitalWrite(LED_ACK, LOW);
+    FastPin<LED_ACK>::low();
     if (pulseCount > 0) {
       pulseCount--;
       makeLedAck(&blinkShort[0]);
@@ -246,7 +253,7 @@ void handleAckLed() {
     return;
   }
   ackLedState = !ackLedState;
-  digitalWrite(LED_ACK, ackLedState ? HIGH : LOW);
+  FastPin<LED_ACK>::write(ackLedState);
 }
 
 void commandClear() {